@@ -9,11 +9,25 @@
 #include <sys/types.h>
 #include <iomanip>
 #include "Commands.h"
-#include <regex>
+#include "signals.h"
 #include <sys/syscall.h>
 #include <linux/limits.h>
 #include <dirent.h>
 #include <time.h>
+#include <spawn.h>
+#include <algorithm>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <climits>
+#include <thread>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 
 using namespace std;
 extern char** environ;
@@ -31,6 +45,28 @@ const std::string WHITESPACE = " \n\r\t\f\v";
 #define SYSINFO_BUFFER_SIZE 2048
 #endif
 
+// the pidfd calls by number, for C libraries older than the kernel; a kernel
+// older than Linux 5.3 fails them with ENOSYS
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+/**
+ * Moves a descriptor the shell keeps open to SHELL_FD_BASE or above, so
+ * that redirections such as 3>&- or <&4 cannot reach it. fd is returned
+ * as it is when it cannot be moved.
+ */
+static int _shellFd(int fd) {
+    if (fd == -1 || fd >= SHELL_FD_BASE) return fd;
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+    if (moved == -1) return fd;
+    close(fd);
+    return moved;
+}
+
 struct linux_dirent {
     unsigned long  current_ino;
     unsigned long  current_off;
@@ -53,18 +89,302 @@ string _trim(const std::string &s) {
     return _rtrim(_ltrim(s));
 }
 
-int _parseCommandLine(const char *cmd_line, char **args) {
-    FUNC_ENTRY()
-    int i = 0;
-    std::istringstream iss(_trim(string(cmd_line)).c_str());
-    for (std::string s; iss >> s;) {
-        args[i] = (char *) malloc(s.length() + 1);
-        memset(args[i], 0, s.length() + 1);
-        strcpy(args[i], s.c_str());
-        args[++i] = NULL;
+static inline bool _isWhitespace(char ch) {
+    return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t' || ch == '\f' || ch == '\v';
+}
+
+static inline bool _isOperator(char ch) {
+    return ch == '|' || ch == '&' || ch == ';' || ch == '>' || ch == '<';
+}
+
+// parses a non-negative decimal number that fits in an int
+static bool _parseNumber(const char *str, int *value) {
+    if (str == nullptr || *str == '\0') return false;
+    long result = 0;
+    for (const char *c = str; *c != '\0'; c++) {
+        if (*c < '0' || *c > '9') return false;
+        result = result * 10 + (*c - '0');
+        if (result > 2147483647L) return false;
+    }
+    *value = (int) result;
+    return true;
+}
+
+/** Returns word with its quotes removed. */
+static string _unquote(const char *word) {
+    string result;
+    char quote = '\0';
+    for (const char *c = word; *c; c++) {
+        if (quote && *c == quote) quote = '\0';
+        else if (!quote && (*c == '\'' || *c == '"')) quote = *c;
+        else result.push_back(*c);
+    }
+    return result;
+}
+
+static bool _writeAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/** perror() onto a stream, so the message follows the command's redirections. */
+static void _perror(std::ostream &err, const char *message) {
+    const char *reason = strerror(errno);
+    err << message << ": " << reason << endl;
+}
+
+int ParsedLine::storeText(const char *line, int begin, int end) {
+    int offset = (int) buffer.size();
+    buffer.insert(buffer.end(), line + begin, line + end);
+    buffer.push_back('\0');
+    return offset;
+}
+
+/**
+ * Splits line[begin, end) into tokens in a single pass. Quoted text is kept
+ * verbatim (quotes included) and never split. A word in command position that
+ * names an alias is replaced by the precompiled tokens of the alias value.
+ */
+void ParsedLine::lex(const char *line, int begin, int end, const AliasTable *aliases) {
+    bool command_position = true;
+    bool after_redirection = false;
+    int i = begin;
+    while (i < end) {
+        char ch = line[i];
+        if (_isWhitespace(ch)) {
+            i++;
+            continue;
+        }
+        Token token;
+        token.fd = -1;
+        token.word = -1;
+        token.begin = i;
+        // digits directly before < or > name the descriptor, as in 2>&1
+        int digits = 0;
+        while (!after_redirection && digits < 9 && i + digits < end && isdigit((unsigned char) line[i + digits])) {
+            digits++;
+        }
+        if (digits && i + digits < end && (line[i + digits] == '>' || line[i + digits] == '<')) {
+            token.fd = atoi(line + i);
+            i += digits;
+            ch = line[i];
+        }
+        if (_isOperator(ch)) {
+            if (ch == '|' && i + 1 < end && line[i + 1] == '&') {
+                token.type = TOKEN_PIPE_ERR;
+                i += 2;
+            } else if (ch == '<' && i + 1 < end && line[i + 1] == '<') {
+                bool here_string = i + 2 < end && line[i + 2] == '<';
+                token.type = here_string ? TOKEN_HERESTRING : TOKEN_HEREDOC;
+                i += here_string ? 3 : 2;
+            } else if ((ch == '>' || ch == '<') && i + 1 < end && line[i + 1] == '&') {
+                token.type = TOKEN_DUPLICATE;
+                i += 2;
+            } else if (ch == '>' && i + 1 < end && line[i + 1] == '>') {
+                token.type = TOKEN_APPEND;
+                i += 2;
+            } else {
+                token.type = ch == '|' ? TOKEN_PIPE : ch == '&' ? TOKEN_BACKGROUND :
+                             ch == ';' ? TOKEN_SEPARATOR : ch == '<' ? TOKEN_INPUT : TOKEN_OVERWRITE;
+                i++;
+            }
+            if (token.fd == -1) token.fd = ch == '<' ? STDIN_FILENO : STDOUT_FILENO;
+            after_redirection = token.type == TOKEN_OVERWRITE || token.type == TOKEN_APPEND ||
+                                token.type == TOKEN_INPUT || token.type == TOKEN_DUPLICATE ||
+                                token.type == TOKEN_HEREDOC || token.type == TOKEN_HERESTRING;
+            command_position = !after_redirection;
+        } else {
+            token.type = TOKEN_WORD;
+            token.word = (int) buffer.size();
+            char quote = '\0';
+            while (i < end && (quote || (!_isWhitespace(line[i]) && !_isOperator(line[i])))) {
+                if (quote && line[i] == quote) quote = '\0';
+                else if (!quote && (line[i] == '\'' || line[i] == '"')) quote = line[i];
+                buffer.push_back(line[i++]);
+            }
+            buffer.push_back('\0');
+            if (after_redirection) {
+                after_redirection = false;
+            } else if (command_position) {
+                command_position = false;
+                const AliasTable::Alias *alias = aliases ? aliases->find(&buffer[token.word]) : nullptr;
+                if (alias) {
+                    buffer.resize(token.word);
+                    expand(alias->expansion, token.begin, i);
+                    continue;
+                }
+            }
+        }
+        token.end = i;
+        tokens.push_back(token);
+    }
+}
+
+/**
+ * Appends the tokens of an alias value, attributed to the span [begin, end)
+ * of the alias name in the original line.
+ */
+void ParsedLine::expand(const Expansion &expansion, int begin, int end) {
+    int base = (int) buffer.size();
+    buffer.insert(buffer.end(), expansion.buffer.begin(), expansion.buffer.end());
+    for (Token token : expansion.tokens) {
+        if (token.word >= 0) token.word += base;
+        token.begin = begin;
+        token.end = end;
+        tokens.push_back(token);
+    }
+}
+
+void ParsedLine::compile(const std::string &value, Expansion &expansion) {
+    ParsedLine scratch;
+    scratch.lex(value.c_str(), 0, (int) value.size(), nullptr);
+    expansion.buffer.swap(scratch.buffer);
+    expansion.tokens.swap(scratch.tokens);
+}
+
+bool ParsedLine::parse(const char *cmd_line, const AliasTable &aliases) {
+    buffer.clear();
+    tokens.clear();
+    wordOffsets.clear();
+    targetOffsets.clear();
+    pendingCommands.clear();
+    pendingPipelines.clear();
+    words.clear();
+    redirections.clear();
+    commands.clear();
+    pipelines.clear();
+    error.clear();
+
+    int length = (int) strlen(cmd_line);
+    lex(cmd_line, 0, length, &aliases);
+
+    bool in_command = false;
+    bool in_pipeline = false;
+    bool pipe_pending = false;
+    int command_begin = 0, command_end = 0, pipeline_begin = 0;
+    auto open_command = [&](const Token &token) {
+        if (!in_pipeline) {
+            in_pipeline = true;
+            pipeline_begin = token.begin;
+            PendingPipeline pending = {(int) commands.size(), -1};
+            pendingPipelines.push_back(pending);
+            PipelineNode node = {nullptr, 0, false, nullptr};
+            pipelines.push_back(node);
+        }
+        if (!in_command) {
+            in_command = true;
+            pipe_pending = false;
+            command_begin = token.begin;
+            PendingCommand pending = {(int) wordOffsets.size(), (int) targetOffsets.size(), -1};
+            pendingCommands.push_back(pending);
+            CommandNode node = {nullptr, 0, nullptr, 0, false, nullptr};
+            commands.push_back(node);
+            pipelines.back().stageCount++;
+        }
+    };
+    auto close_command = [&]() {
+        if (!in_command) return;
+        in_command = false;
+        wordOffsets.push_back(-1);
+        pendingCommands.back().text = storeText(cmd_line, command_begin, command_end);
+    };
+    auto syntax_error = [&](const Token &token) {
+        error = "smash error: syntax error near unexpected token '" +
+                string(cmd_line + token.begin, token.end - token.begin) + "'";
+        return false;
+    };
+
+    for (size_t t = 0; t < tokens.size(); t++) {
+        const Token &token = tokens[t];
+        switch (token.type) {
+            case TOKEN_WORD:
+                open_command(token);
+                wordOffsets.push_back(token.word);
+                commands.back().argc++;
+                command_end = token.end;
+                break;
+            case TOKEN_OVERWRITE:
+            case TOKEN_APPEND:
+            case TOKEN_INPUT:
+            case TOKEN_DUPLICATE:
+            case TOKEN_HEREDOC:
+            case TOKEN_HERESTRING: {
+                open_command(token);
+                RedirectionType type = token.type == TOKEN_APPEND ? REDIRECT_APPEND :
+                                       token.type == TOKEN_INPUT ? REDIRECT_INPUT :
+                                       token.type == TOKEN_DUPLICATE ? REDIRECT_DUPLICATE :
+                                       token.type == TOKEN_HEREDOC ? REDIRECT_HEREDOC :
+                                       token.type == TOKEN_HERESTRING ? REDIRECT_HERESTRING : REDIRECT_OVERWRITE;
+                Redirection redirection = {type, token.fd, nullptr};
+                redirections.push_back(redirection);
+                commands.back().redirectionCount++;
+                command_end = token.end;
+                if (t + 1 < tokens.size() && tokens[t + 1].type == TOKEN_WORD) {
+                    t++;
+                    targetOffsets.push_back(tokens[t].word);
+                    command_end = tokens[t].end;
+                } else if (type == REDIRECT_HEREDOC) {
+                    return syntax_error(token);
+                } else {
+                    // no target: opening "" reports the error when the command runs
+                    targetOffsets.push_back(storeText("", 0, 0));
+                }
+                break;
+            }
+            case TOKEN_PIPE:
+            case TOKEN_PIPE_ERR:
+                if (!in_command) return syntax_error(token);
+                commands.back().pipeStderr = token.type == TOKEN_PIPE_ERR;
+                close_command();
+                pipe_pending = true;
+                break;
+            case TOKEN_BACKGROUND:
+            case TOKEN_SEPARATOR:
+                if (!in_command) return syntax_error(token);
+                close_command();
+                in_pipeline = false;
+                pipelines.back().background = token.type == TOKEN_BACKGROUND;
+                pendingPipelines.back().text = storeText(cmd_line, pipeline_begin, token.end);
+                break;
+        }
+    }
+    if (pipe_pending && !in_command) return syntax_error(tokens.back());
+    if (in_pipeline) {
+        close_command();
+        pendingPipelines.back().text = storeText(cmd_line, pipeline_begin, command_end);
+    }
+    // a lone pipeline is printed exactly as typed
+    if (pipelines.size() == 1) pendingPipelines[0].text = storeText(cmd_line, 0, length);
+    finish();
+    return true;
+}
+
+void ParsedLine::finish() {
+    // the buffer no longer grows, so offsets can become pointers
+    words.resize(wordOffsets.size());
+    for (size_t i = 0; i < wordOffsets.size(); i++) {
+        words[i] = wordOffsets[i] < 0 ? nullptr : &buffer[wordOffsets[i]];
+    }
+    for (size_t i = 0; i < redirections.size(); i++) {
+        redirections[i].target = &buffer[targetOffsets[i]];
+    }
+    for (size_t i = 0; i < commands.size(); i++) {
+        commands[i].argv = &words[pendingCommands[i].firstWord];
+        commands[i].redirections = redirections.data() + pendingCommands[i].firstRedirection;
+        commands[i].text = &buffer[pendingCommands[i].text];
+    }
+    for (size_t i = 0; i < pipelines.size(); i++) {
+        pipelines[i].stages = &commands[pendingPipelines[i].firstStage];
+        pipelines[i].text = &buffer[pendingPipelines[i].text];
     }
-    return i;
-    FUNC_EXIT()
 }
 
 
@@ -91,546 +411,1883 @@ void _removeBackgroundSign(char *cmd_line) {
     cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
 }
 
-void JobsList::removeJobById(int jobId) {
-    for (unsigned int i = 0; i < jobsVector.size(); ++i) {
-        if (jobsVector[i]->getJobId() == jobId) {
-            waitpid(jobsVector[i] ->getPid(), nullptr, WNOHANG);
-            jobsVector.erase(jobsVector.begin() + i);
-            return;
-        }
-    }
+/**
+ * A pidfd is opened as soon as the job is added. The child cannot have been
+ * reaped yet, so the pidfd is sure to refer to it, and from then on signals
+ * and waits cannot reach another process that reuses the pid.
+ */
+JobsList::JobEntry::JobEntry(pid_t m_pid, const char *line, BuiltinJob *builtin)
+    : pid(m_pid), commandLine(line), builtin(builtin) {
+    if (!builtin) pidfd = _shellFd((int) syscall(SYS_pidfd_open, pid, 0));
+    clock_gettime(CLOCK_MONOTONIC, &started);
 }
 
-void JobsList::removeFinishedJobs() {
-    auto it = jobsVector.begin();
+void JobsList::JobEntry::finish(int status, const struct rusage &usage) {
+    finished = true;
+    stopped = false;
+    this->status = status;
+    this->usage = usage;
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    if (pidfd != -1) close(pidfd);
+    pidfd = -1;
+}
 
-    while (it != jobsVector.end()) {
-        pid_t pid = it.operator*()->getPid();
-        int status;
+static void _printSeconds(std::ostream &out, long seconds, long milliseconds) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%ld.%03lds", seconds, milliseconds);
+    out << buffer;
+}
+
+void JobsList::JobEntry::printLong(std::ostream &out) const {
+    out << '[' << jobId << "] " << commandLine << " : ";
+    if (builtin) out << "builtin ";
+    else out << pid << ' ';
+    if (!finished) out << (stopped ? "stopped" : "running");
+    else if (WIFSIGNALED(status)) out << "signal=" << WTERMSIG(status);
+    else out << "exit=" << WEXITSTATUS(status);
+    struct timespec end = ended;
+    if (!finished) clock_gettime(CLOCK_MONOTONIC, &end);
+    long wall = (end.tv_sec - started.tv_sec) * 1000 + (end.tv_nsec - started.tv_nsec) / 1000000;
+    out << " wall=";
+    _printSeconds(out, wall / 1000, wall % 1000);
+    if (finished) {
+        out << " user=";
+        _printSeconds(out, usage.ru_utime.tv_sec, usage.ru_utime.tv_usec / 1000);
+        out << " sys=";
+        _printSeconds(out, usage.ru_stime.tv_sec, usage.ru_stime.tv_usec / 1000);
+        out << " maxrss=" << usage.ru_maxrss << 'K' << " majflt=" << usage.ru_majflt
+            << " minflt=" << usage.ru_minflt << " nvcsw=" << usage.ru_nvcsw << " nivcsw=" << usage.ru_nivcsw;
+    }
+    out << '\n';
+}
 
-        pid_t result = waitpid(pid, &status, WNOHANG);
+JobsList::JobEntry::~JobEntry() {
+    delete builtin;
+    if (pidfd != -1) close(pidfd);
+}
 
-        if (result == pid) {
-            it = jobsVector.erase(it);
+bool JobsList::JobEntry::sendSignal(int signum) {
+    if (builtin) {
+        switch (signum) {
+            case 0: case SIGCHLD: case SIGURG: case SIGWINCH:
+                return true; // a process would ignore these too
+            case SIGSTOP: case SIGTSTP: case SIGTTIN: case SIGTTOU: case SIGCONT:
+                errno = ENOTSUP;
+                return false;
         }
-        else if (result == -1) {
-            it = jobsVector.erase(it);
+        if (signum < 0 || signum > SIGRTMAX) {
+            errno = EINVAL;
+            return false;
         }
-        else {
-            ++it;
+        builtin->command->cancel(signum);
+        return true;
+    }
+    if (pidfd != -1) {
+        if (syscall(SYS_pidfd_send_signal, pidfd, signum, nullptr, 0) == 0) return true;
+        if (errno != ENOSYS) return false;
+    }
+    return kill(pid, signum) == 0;
+}
+
+bool JobsList::JobEntry::wait() {
+    SmallShell& smash = SmallShell::getInstance();
+    if (builtin) {
+        smash.waitForeground(builtin->doneFd);
+        builtin->wait();
+        finish(builtin->status(), builtin->usage);
+        return true;
+    }
+    sendSignal(SIGCONT);
+    stopped = false;
+    int result = 0;
+    struct rusage ended;
+    pid_t reaped = smash.reapForeground(pid, pidfd, &result, &ended);
+    stopped = reaped == pid && WIFSTOPPED(result);
+    if (reaped == pid && !stopped) finish(result, ended);
+    return !stopped;
+}
+
+void JobsList::insert(JobEntry *job) {
+    job->set_jobID(getNextJobID());
+    if (slots.empty()) slots.push_back(nullptr);
+    slots.push_back(job);
+    count++;
+    if (!job->getBuiltin()) idsByPid[job->getPid()] = job->getJobId();
+}
+
+void JobsList::release(int jobId) {
+    JobEntry* job = slots[jobId];
+    if (!job->getBuiltin()) idsByPid.erase(job->getPid());
+    if (job->isFinished()) {
+        history.push_back(job);
+        if (history.size() > JOB_HISTORY_SIZE) {
+            delete history.front();
+            history.pop_front();
         }
+    } else {
+        delete job;
     }
+    slots[jobId] = nullptr;
+    count--;
+    while (!slots.empty() && !slots.back()) slots.pop_back();
+    if (slots.size() == 1) slots.clear();
 }
 
-int JobsList::getNextJobID() {
-    removeFinishedJobs();
-    int maxId = 0;
-    for (const auto &job : jobsVector) {
-        if (job->getJobId() > maxId) {
-            maxId = job->getJobId();
+void JobsList::removeJobById(int jobId) {
+    JobEntry* job = getJobById(jobId);
+    if (!job) return;
+    int status;
+    struct rusage usage;
+    if (!job->getBuiltin() && !job->isFinished() && wait4(job->getPid(), &status, WNOHANG, &usage) > 0) {
+        job->finish(status, usage);
+    }
+    release(jobId);
+}
+
+void JobsList::removeJobByPid(pid_t pid) {
+    auto found = idsByPid.find(pid);
+    if (found != idsByPid.end()) release(found->second);
+}
+
+/**
+ * The signals the shell takes through signalfds. They stay blocked in the
+ * shell, and children unblock them before they exec.
+ */
+static void _shellSignals(sigset_t *set) {
+    sigemptyset(set);
+    sigaddset(set, SIGCHLD);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTSTP);
+}
+
+/**
+ * Removes the jobs that finished since the last call. SIGCHLD and finishing
+ * builtin jobs make the child signalfd or the wake pipe readable, so when
+ * nothing happened this is two read()s. Only the builtin jobs the pool
+ * reported finished are looked at. Must not run while a foreground
+ * child is being waited for.
+ */
+void JobsList::drainChildFd() {
+    struct signalfd_siginfo drained;
+    while (read(childFd, &drained, sizeof(drained)) > 0) {
+        childChanged = true;
+    }
+}
+
+void JobsList::removeFinishedJobs(std::ostream *done) {
+    char drained[sizeof(struct signalfd_siginfo)];
+    bool woken = childChanged;
+    childChanged = false;
+    while (read(wakePipe[0], drained, sizeof(drained)) > 0) {
+        woken = true;
+    }
+    while (read(childFd, drained, sizeof(drained)) > 0) {
+        woken = true;
+    }
+    if (!woken) return;
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        auto found = idsByPid.find(pid);
+        if (found == idsByPid.end()) continue;
+        if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+            slots[found->second]->setStopped(WIFSTOPPED(status));
+            continue;
         }
+        slots[found->second]->finish(status, usage);
+        if (done) *done << '[' << found->second << "] Done: " << slots[found->second]->getCommandLine() << '\n';
+        release(found->second);
+    }
+    pool.takeFinished(finishedBuiltins);
+    for (int id : finishedBuiltins) {
+        // the job may have been waited for by fg, and its id taken by a newer one
+        BuiltinJob* builtin = id < (int) slots.size() && slots[id] ? slots[id]->getBuiltin() : nullptr;
+        struct pollfd pfd = {builtin ? builtin->doneFd : -1, POLLIN, 0};
+        if (!builtin || poll(&pfd, 1, 0) != 1) continue;
+        slots[id]->finish(builtin->status(), builtin->usage);
+        if (done) *done << '[' << id << "] Done: " << slots[id]->getCommandLine() << '\n';
+        release(id);
+    }
+}
+
+JobsList::JobsList() {
+    if (pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("smash error: pipe failed");
+        wakePipe[0] = wakePipe[1] = -1;
+    }
+    wakePipe[0] = _shellFd(wakePipe[0]);
+    wakePipe[1] = _shellFd(wakePipe[1]);
+    pool.setWakeFd(wakePipe[1]);
+    sigset_t children;
+    sigemptyset(&children);
+    sigaddset(&children, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &children, nullptr);
+    signal(SIGCHLD, SIG_DFL); // an inherited SIG_IGN would reap children for us
+    childFd = _shellFd(signalfd(-1, &children, SFD_CLOEXEC | SFD_NONBLOCK));
+    if (childFd == -1) {
+        perror("smash error: signalfd failed");
     }
-    return maxId + 1;
+}
+
+JobsList::~JobsList() {
+    for (JobEntry* job : slots) {
+        if (job && job->getBuiltin()) {
+            job->getBuiltin()->command->cancel(SIGKILL);
+            job->getBuiltin()->wait();
+        }
+        delete job;
+    }
+    for (JobEntry* job : history) {
+        delete job;
+    }
+    pool.stop();
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    close(childFd);
+}
+
+int JobsList::getNextJobID() {
+    return slots.empty() ? 1 : (int) slots.size();
 }
 
 void JobsList::send_SIGKILL_to_all_jobs() {
-    for (auto &job: jobsVector) {
-        kill(job->getPid(), SIGKILL);
+    for (JobEntry* job : slots) {
+        if (job) job->sendSignal(SIGKILL);
+    }
+}
+
+EventLoop::EventLoop() {
+    epollFd = _shellFd(epoll_create1(EPOLL_CLOEXEC));
+    if (epollFd == -1) {
+        perror("smash error: epoll_create1 failed");
     }
 }
 
+EventLoop::~EventLoop() {
+    close(epollFd);
+}
 
-bool JobsList::is_there_a_job_with_pid(const int pid) {
-    removeFinishedJobs();
-    for (const auto &job : jobsVector) {
-        if (job->getPid() == pid) {
-            return true;
+bool EventLoop::watch(int fd, Handler handler) {
+    if (fd < 0 || sources.count(fd)) return false;
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    Source source = {std::make_shared<Handler>(std::move(handler)), false};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        if (errno != EPERM) return false;
+        source.alwaysReady = true;
+        alwaysReady++;
+    }
+    sources[fd] = std::move(source);
+    return true;
+}
+
+void EventLoop::unwatch(int fd) {
+    auto found = sources.find(fd);
+    if (found == sources.end()) return;
+    if (found->second.alwaysReady) alwaysReady--;
+    else epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    sources.erase(found);
+}
+
+void EventLoop::dispatch(int fd) {
+    auto found = sources.find(fd);
+    if (found == sources.end()) return; // removed by an earlier handler
+    // held, since the handler may remove its own source
+    std::shared_ptr<Handler> handler = found->second.handler;
+    (*handler)();
+}
+
+void EventLoop::run() {
+    struct epoll_event events[16];
+    std::vector<int> ready;
+    running = true;
+    while (running) {
+        int count = epoll_wait(epollFd, events, 16, alwaysReady ? 0 : -1);
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            perror("smash error: epoll_wait failed");
+            return;
+        }
+        for (int i = 0; i < count && running; i++) {
+            dispatch(events[i].data.fd);
+        }
+        if (!alwaysReady) continue;
+        ready.clear();
+        for (auto& source : sources) {
+            if (source.second.alwaysReady) ready.push_back(source.first);
+        }
+        for (size_t i = 0; i < ready.size() && running; i++) {
+            dispatch(ready[i]);
         }
     }
-    return false;
 }
 
-JobsList::JobEntry* JobsList::getJobById(int jobId) {
-    removeFinishedJobs();
-    for (JobEntry* job: jobsVector) {
-        if (job->getJobId() == jobId)
-            return job;
+
+bool JobsList::is_there_a_job_with_pid(const int pid) {
+    return idsByPid.count(pid) != 0;
+}
+
+JobsList::JobEntry *JobsList::getLastStoppedJob(int *jobId) {
+    for (size_t id = slots.size(); id-- > 1;) {
+        if (slots[id] && slots[id]->isStopped()) {
+            if (jobId) *jobId = (int) id;
+            return slots[id];
+        }
     }
     return nullptr;
 }
 
+JobsList::JobEntry* JobsList::getJobById(int jobId) {
+    if (jobId <= 0 || jobId >= (int) slots.size()) return nullptr;
+    return slots[jobId];
+}
+
 
-void JobsList::addJob(Command *cmd, pid_t pid_to_use) {
-    removeFinishedJobs();
+void JobsList::addJob(Command *cmd, pid_t pid_to_use, bool stopped) {
     pid_t m_pid = pid_to_use;
-    string cmdLine = cmd->getCmdLine_Print();
-    JobEntry* newJob = new JobEntry(m_pid, cmdLine);
-    newJob->set_jobID(this->getNextJobID());
-    jobsVector.push_back(newJob);
+    JobEntry* job = new JobEntry(m_pid, cmd->getCmdLine());
+    job->setStopped(stopped);
+    insert(job);
    // cout << "added: "<< newJob->getCommandLine() << endl;
 }
 
+bool JobsList::addBuiltinJob(Command *cmd) {
+    int done_fd = _shellFd(eventfd(0, EFD_CLOEXEC));
+    if (done_fd == -1) {
+        perror("smash error: eventfd failed");
+        return false;
+    }
+    BuiltinJob* builtin = new BuiltinJob(cmd, done_fd);
+    JobEntry* job = new JobEntry(0, cmd->getCmdLine(), builtin); // no process of its own
+    insert(job);
+    builtin->jobId = job->getJobId();
+    pool.submit(builtin);
+    return true;
+}
 
-void JobsList::printJobsList_forJOBS() {
-    removeFinishedJobs();
-    if (jobsVector.empty()) {
-        return;
+BuiltinJob::~BuiltinJob() {
+    delete command;
+    close(doneFd);
+}
+
+void BuiltinJob::wait() {
+    uint64_t count;
+    while (read(doneFd, &count, sizeof(count)) == -1 && errno == EINTR) {
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    stop();
+}
+
+void ThreadPool::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
     }
-    string resault;
-    for (const auto &job : jobsVector) {
-        resault += "[" + std::to_string(job->getJobId()) + "] " +
-                       job->getCommandLine()  + "\n";
-       // std::cout << job->getCommandLine() << endl;
+    ready.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+/**
+ * Queues a job, starting another worker if none is idle. Workers are started
+ * with every signal blocked so signals are still handled by the main thread.
+ */
+void ThreadPool::submit(BuiltinJob *job) {
+    std::lock_guard<std::mutex> guard(lock);
+    queue.push_back(job);
+    if (idle < queue.size() && workers.size() < WORKERS) {
+        sigset_t all, previous;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &previous);
+        workers.emplace_back(&ThreadPool::work, this);
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
+    ready.notify_one();
+}
+
+void ThreadPool::takeFinished(std::vector<int> &ids) {
+    ids.clear();
+    std::lock_guard<std::mutex> guard(lock);
+    ids.swap(finished);
+}
+
+/**
+ * Runs queued jobs with their output going straight to stdout. Signalling
+ * doneFd is the last thing a worker does with a job, since the shell may
+ * free the job as soon as it sees the eventfd readable; its id is then
+ * queued for takeFinished().
+ */
+void ThreadPool::work() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        idle++;
+        ready.wait(guard, [this] { return stopping || !queue.empty(); });
+        idle--;
+        if (queue.empty()) return;
+        BuiltinJob* job = queue.front();
+        queue.pop_front();
+        guard.unlock();
+        struct rusage before, after;
+        getrusage(RUSAGE_THREAD, &before);
+        if (!job->command->isCancelled()) {
+            FdSink sink(STDOUT_FILENO);
+            std::ostream out(&sink);
+            job->command->setOutput(&out);
+            job->command->execute();
+            out.flush();
+            job->command->setOutput(&std::cout);
+        }
+        getrusage(RUSAGE_THREAD, &after);
+        timersub(&after.ru_utime, &before.ru_utime, &job->usage.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &job->usage.ru_stime);
+        job->usage.ru_maxrss = after.ru_maxrss;
+        job->usage.ru_minflt = after.ru_minflt - before.ru_minflt;
+        job->usage.ru_majflt = after.ru_majflt - before.ru_majflt;
+        job->usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+        job->usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+        int jobId = job->jobId;
+        uint64_t one = 1;
+        while (write(job->doneFd, &one, sizeof(one)) == -1 && errno == EINTR) {
+        }
+        guard.lock();
+        finished.push_back(jobId);
+        char byte = 0;
+        if (wakeFd != -1 && write(wakeFd, &byte, 1) == -1) {
+            // the pipe is full, so a wake-up is already pending
+        }
+    }
+}
+
+
+void JobsList::printJobsList_forJOBS(std::ostream &out) {
+    for (JobEntry* job : slots) {
+        if (!job) continue;
+        out << '[' << job->getJobId() << "] " << job->getCommandLine();
+        out << (job->isStopped() ? " (stopped)\n" : "\n");
     }
-    std::cout << resault;
+    out.flush();
 }
 
-void JobsList::printJobsList_forQUIT() {
+void JobsList::printJobsList_long(std::ostream &out) {
+    for (JobEntry* job : slots) {
+        if (job) job->printLong(out);
+    }
+    for (JobEntry* job : history) {
+        job->printLong(out);
+    }
+    out.flush();
+}
+
+void JobsList::printJobsList_forQUIT(std::ostream &out) {
     removeFinishedJobs();
-    cout << "smash: sending SIGKILL signal to " << this->jobsVector.size() << " jobs:" << endl;
-    if (this->jobsVector.size() == 0)
+    out << "smash: sending SIGKILL signal to " << count << " jobs:" << endl;
+    if (count == 0)
         return;
-    string resault;
-    for (const auto &job : jobsVector) {
-        resault += std::to_string(job->getPid()) + ": " +
-                       job->getCommandLine()  + "\n";
+    for (JobEntry* job : slots) {
+        if (!job) continue;
+        if (job->getBuiltin()) out << "builtin";
+        else out << job->getPid();
+        out << ": " << job->getCommandLine() << '\n';
     }
-    std::cout << resault;
+    out.flush();
     send_SIGKILL_to_all_jobs();
-    exit(0);
 }
 
 
+const AliasTable::Alias *AliasTable::find(const char *name) const {
+    key.assign(name);
+    auto found = index.find(key);
+    return found == index.end() ? nullptr : &*found->second;
+}
+
+bool AliasTable::add(const std::string &name, const std::string &value) {
+    if (index.count(name)) return false;
+    aliases.emplace_back();
+    Alias &alias = aliases.back();
+    alias.name = name;
+    alias.value = value;
+    ParsedLine::compile(value, alias.expansion);
+    index[name] = std::prev(aliases.end());
+    return true;
+}
+
+bool AliasTable::remove(const std::string &name) {
+    auto found = index.find(name);
+    if (found == index.end()) return false;
+    aliases.erase(found->second);
+    index.erase(found);
+    return true;
+}
+
+void PathCache::validate() {
+    const char *path = getenv("PATH");
+    if (!path) path = "/bin:/usr/bin";
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bool changed = !pathSet || pathValue != path;
+    if (changed) {
+        pathValue = path;
+        pathSet = true;
+        directories.clear();
+        const char *begin = path;
+        while (true) {
+            const char *end = strchr(begin, ':');
+            Directory directory;
+            directory.path.assign(begin, end ? end - begin : strlen(begin));
+            if (directory.path.empty()) directory.path = ".";
+            directory.mtime = {0, 0};
+            directories.push_back(directory);
+            if (!end) break;
+            begin = end + 1;
+        }
+    } else if (now.tv_sec == lastCheck) {
+        return;
+    }
+    lastCheck = now.tv_sec;
+    for (Directory &directory : directories) {
+        struct stat sb;
+        struct timespec mtime = {0, 0};
+        if (stat(directory.path.c_str(), &sb) == 0) mtime = sb.st_mtim;
+        if (mtime.tv_sec != directory.mtime.tv_sec || mtime.tv_nsec != directory.mtime.tv_nsec) {
+            directory.mtime = mtime;
+            changed = true;
+        }
+    }
+    if (changed) entries.clear();
+}
+
+const char *PathCache::find(const char *name) {
+    if (strchr(name, '/')) return name;
+    validate();
+    key.assign(name);
+    auto found = entries.find(key);
+    if (found == entries.end()) {
+        Entry &entry = entries[key];
+        for (const Directory &directory : directories) {
+            candidate.assign(directory.path).append("/").append(name);
+            struct stat sb;
+            if (stat(candidate.c_str(), &sb) == 0 && S_ISREG(sb.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+                entry.path = candidate;
+                break;
+            }
+        }
+        found = entries.find(key);
+    }
+    if (found->second.path.empty()) return nullptr;
+    found->second.hits++;
+    return found->second.path.c_str();
+}
+
+void PathCache::forget(const char *name) {
+    key.assign(name);
+    entries.erase(key);
+}
+
+void PathCache::print(std::ostream &out) const {
+    std::vector<const std::pair<const std::string, Entry> *> found;
+    for (const auto &entry : entries) {
+        if (!entry.second.path.empty()) found.push_back(&entry);
+    }
+    if (found.empty()) {
+        out << "smash: hash table empty" << endl;
+        return;
+    }
+    std::sort(found.begin(), found.end(), [](const std::pair<const std::string, Entry> *a,
+                                             const std::pair<const std::string, Entry> *b) {
+        return a->first < b->first;
+    });
+    out << "hits\tcommand" << endl;
+    for (const auto *entry : found) {
+        out << std::setw(4) << entry->second.hits << "\t" << entry->second.path << endl;
+    }
+}
+
+const ParsedLine &ParseCache::lookup(const char *cmd_line, const AliasTable &aliases) {
+    key.assign(cmd_line);
+    auto found = index.find(key);
+    if (found != index.end()) {
+        auto entry = found->second;
+        entries.splice(entries.begin(), entries, entry);
+        if (entry->generation == generation) {
+            hits++;
+            return entry->parsed;
+        }
+        misses++;
+        entry->generation = generation;
+        entry->parsed.parse(cmd_line, aliases);
+        return entry->parsed;
+    }
+    misses++;
+    if (entries.size() >= capacity) {
+        // recycle the least recently used entry and its buffers
+        auto last = std::prev(entries.end());
+        index.erase(last->line);
+        entries.splice(entries.begin(), entries, last);
+    } else {
+        entries.emplace_front();
+    }
+    Entry& entry = entries.front();
+    entry.line = key;
+    entry.generation = generation;
+    entry.parsed.parse(cmd_line, aliases);
+    index[entry.line] = entries.begin();
+    return entry.parsed;
+}
+
+void ParseCache::clear() {
+    invalidate();
+    hits = 0;
+    misses = 0;
+}
+
+void ParseCache::setCapacity(size_t new_capacity) {
+    capacity = new_capacity;
+    // the front entry is the line being executed, never drop it
+    while (entries.size() > capacity && entries.size() > 1) {
+        index.erase(entries.back().line);
+        entries.pop_back();
+    }
+}
+
 SmallShell::SmallShell() :
-previousDir(nullptr) , aliasVector({}), m_job_list(new JobsList()) {
+previousDir(nullptr) , aliasTable(), parseCache(PARSE_CACHE_SIZE), m_job_list(new JobsList()) {
+    void* shared = mmap(nullptr, sizeof(PipeStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        static PipeStats local;
+        shared = &local;
+    }
+    pipeStats = static_cast<PipeStats*>(shared);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    // children inherit the disposition, and a shell started in the
+    // background may have been given SIG_IGN
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signalFd = _shellFd(signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK));
+    if (signalFd == -1) {
+        perror("smash error: signalfd failed");
+    }
 }
 
 SmallShell::~SmallShell() {
     delete m_job_list;
+    close(signalFd);
+}
+
+void SmallShell::handleSignals() {
+    struct signalfd_siginfo info;
+    while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGINT) ctrlCHandler(SIGINT);
+        if (info.ssi_signo == SIGTSTP) ctrlZHandler(SIGTSTP);
+    }
+}
+
+void SmallShell::pollSignals() {
+    if (++signalPolls % SIGNAL_POLL_INTERVAL || std::this_thread::get_id() != mainThread) return;
+    struct pollfd pfd = {signalFd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) == 1) handleSignals();
+}
+
+static long _millisecondsSince(const struct timespec &start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+int SmallShell::waitForeground(const int *fds, int count, int timeout) {
+    std::vector<struct pollfd> polled(count + 1);
+    for (int i = 0; i < count; i++) {
+        polled[i] = {fds[i], POLLIN, 0};
+    }
+    polled[count] = {signalFd, POLLIN, 0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    foreground.interrupted = false;
+    while (true) {
+        int left = timeout;
+        if (timeout >= 0) {
+            long elapsed = _millisecondsSince(start);
+            left = elapsed >= timeout ? 0 : (int) (timeout - elapsed);
+        }
+        int ready = poll(polled.data(), count + 1, left);
+        if (ready == 0 || (ready == -1 && errno != EINTR)) return -1;
+        if (ready == -1) continue;
+        if (polled[count].revents) handleSignals();
+        for (int i = 0; i < count; i++) {
+            if (polled[i].revents) return i;
+        }
+        if (foreground.stopped || foreground.interrupted) return -1;
+    }
+}
+
+pid_t SmallShell::reapForeground(pid_t pid, int pidfd, int *status, struct rusage *usage) {
+    if (pidfd != -1) {
+        waitForeground(pidfd);
+    } else {
+        // no pidfd (Linux before 5.3): look again after every SIGCHLD
+        int childFd = m_job_list->getChildFd();
+        while (true) {
+            // only a ctrl-Z makes a stop worth reporting
+            pid_t result = wait4(pid, status, WNOHANG | (foreground.stopped ? WUNTRACED : 0), usage);
+            if (result != 0) return result;
+            if (waitForeground(&childFd, 1) == 0) m_job_list->drainChildFd();
+        }
+    }
+    pid_t result;
+    while ((result = wait4(pid, status, foreground.stopped ? WUNTRACED : 0, usage)) == -1 &&
+           errno == EINTR) {
+    }
+    return result;
+}
+
+/** Opens a pidfd for pid and waits for it as SmallShell::reapForeground does. */
+static pid_t _waitForeground(pid_t pid, int *status, struct rusage *usage) {
+    int pidfd = (int) syscall(SYS_pidfd_open, pid, 0);
+    pid_t result = SmallShell::getInstance().reapForeground(pid, pidfd, status, usage);
+    if (pidfd != -1) close(pidfd);
+    return result;
+}
+
+
+/**
+ * Arguments handed to a builtin factory: the command as typed and its
+ * (alias-expanded) words, borrowed from the ParsedLine.
+ */
+struct BuiltinArgs {
+    const char* cmd_line;
+    char** argv;
+    int argc;
+    std::ostream& err;
+};
+
+typedef Command* (*BuiltinFactory)(const BuiltinArgs &args);
+
+enum BuiltinFlags {
+    BUILTIN_DEFAULT = 0,
+    BUILTIN_THREAD_SAFE = 1, // only reads shell state and writes to out()
+    BUILTIN_BACKGROUND = 2   // with a trailing &, runs as a job on a worker thread
+};
+
+struct BuiltinEntry {
+    const char* name;
+    BuiltinFactory create;
+    int flags;
+};
+
+static Command* _createAlias(const BuiltinArgs &args) {
+    return new AliasCommand(args.cmd_line, args.argc);
+}
+
+static Command* _createChangePrompt(const BuiltinArgs &args) {
+    if (args.argc == 1) return new ChangePrompt("");
+    return new ChangePrompt(args.argv[1]);
+}
+
+static Command* _createShowPid(const BuiltinArgs &args) {
+    return new ShowPidCommand(args.cmd_line);
+}
+
+static Command* _createJobs(const BuiltinArgs &args) {
+    return new JobsCommand(args.cmd_line, args.argc > 1 && strcmp(args.argv[1], "-l") == 0);
+}
+
+static Command* _createGetCurrDir(const BuiltinArgs &args) {
+    return new GetCurrDirCommand(args.cmd_line);
+}
+
+static Command* _createChangeDir(const BuiltinArgs &args) {
+    if (args.argc > 2) {
+        args.err<<("smash error: cd: too many arguments")<<endl;
+        return nullptr;
+    }
+    if (args.argc == 1) return nullptr;
+    return new ChangeDirCommand(args.argv[1]);
+}
+
+static Command* _createForeground(const BuiltinArgs &args) {
+    if (args.argc > 2) {
+        args.err<<("smash error: fg: invalid arguments")<<endl;
+        return nullptr;
+    }
+    if (args.argc == 2) {
+        int num_id;
+        if (!_parseNumber(args.argv[1], &num_id)) {
+            args.err<<("smash error: fg: invalid arguments")<<endl;
+            return nullptr;
+        }
+        if (!SmallShell::getInstance().getJobList()->getJobById(num_id)) {
+            string to_throw = "smash error: fg: job-id "+std::to_string(num_id)+" does not exist";
+            args.err<<(to_throw.c_str())<<endl;
+            return nullptr;
+        }
+        return new ForegroundCommand(args.cmd_line, num_id);
+    }
+    return new ForegroundCommand(args.cmd_line);
+}
+
+static Command* _createBackground(const BuiltinArgs &args) {
+    int num_id = 0;
+    if (args.argc > 2 || (args.argc == 2 && !_parseNumber(args.argv[1], &num_id))) {
+        args.err<<("smash error: bg: invalid arguments")<<endl;
+        return nullptr;
+    }
+    return new BackgroundCommand(args.cmd_line, num_id);
+}
+
+static Command* _createWait(const BuiltinArgs &args) {
+    std::vector<int> ids;
+    bool any = false;
+    int timeout = -1;
+    int i = 1;
+    for (; i < args.argc && args.argv[i][0] == '-'; i++) {
+        if (strcmp(args.argv[i], "-n") == 0) {
+            any = true;
+        } else if (strcmp(args.argv[i], "-t") != 0 || i + 1 == args.argc ||
+                   !_parseNumber(args.argv[++i], &timeout) || timeout < 0) {
+            args.err << ("smash error: wait: invalid arguments") << endl;
+            return nullptr;
+        }
+    }
+    for (; i < args.argc; i++) {
+        int id;
+        if (!_parseNumber(args.argv[i], &id)) {
+            args.err << ("smash error: wait: invalid arguments") << endl;
+            return nullptr;
+        }
+        ids.push_back(id);
+    }
+    return new WaitCommand(args.cmd_line, ids, any, timeout);
+}
+
+static Command* _createKill(const BuiltinArgs &args) {
+    int signum, job_id;
+    if (args.argc != 3 || args.argv[1][0] != '-' || !_parseNumber(args.argv[1] + 1, &signum) ||
+        !_parseNumber(args.argv[2], &job_id)) {
+        args.err << ("smash error: kill: invalid arguments") << endl;
+        return nullptr;
+    }
+    return new KillCommand(args.cmd_line, signum, job_id);
+}
+
+static Command* _createWhoAmI(const BuiltinArgs &args) {
+    return new WhoAmICommand(args.cmd_line);
+}
+
+static Command* _createUnAlias(const BuiltinArgs &args) {
+    return new UnAliasCommand(args.argv, args.argc);
+}
+
+static Command* _createSysInfo(const BuiltinArgs &args) {
+    return new SysInfoCommand(args.cmd_line);
+}
+
+static Command* _createQuit(const BuiltinArgs &args) {
+    JobsList* jobs = SmallShell::getInstance().getJobList();
+    if (args.argv[1] && string(args.argv[1]).compare("kill") == 0)
+        return new QuitCommand(args.cmd_line, jobs, true);
+    return new QuitCommand(args.cmd_line, jobs, false);
+}
+
+static Command* _createDiskUsage(const BuiltinArgs &args) {
+    if (args.argc > 2) {
+        args.err<<("smash error: du: too many arguments")<<endl;
+        return nullptr;
+    }
+    if (args.argc == 2) return new DiskUsageCommand(args.cmd_line, string(args.argv[1]));
+    return new DiskUsageCommand(args.cmd_line, "./");
+}
+
+static Command* _createCmdCache(const BuiltinArgs &args) {
+    int capacity = 0;
+    if (args.argc == 1) return new CmdCacheCommand(args.cmd_line, false, 0);
+    if (args.argc == 2 && strcmp(args.argv[1], "-c") == 0) return new CmdCacheCommand(args.cmd_line, true, 0);
+    if (args.argc == 3 && strcmp(args.argv[1], "-s") == 0 && _parseNumber(args.argv[2], &capacity) && capacity > 0) {
+        return new CmdCacheCommand(args.cmd_line, false, capacity);
+    }
+    args.err<<("smash error: cmdcache: invalid arguments")<<endl;
+    return nullptr;
+}
+
+static const char* const SPAWN_BACKEND_NAMES[] = {"posix", "vfork", "fork"};
+
+/**
+ * Parses a byte count with an optional K, M or G suffix.
+ */
+static bool _parseSize(const char* str, long* size) {
+    char* end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (end == str || !isdigit((unsigned char) *str) || errno) return false;
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end || value > (LONG_MAX >> shift)) return false;
+    *size = value << shift;
+    return true;
+}
+
+static Command* _createSet(const BuiltinArgs &args) {
+    if (args.argc == 1) return new SetCommand(args.cmd_line, SET_PRINT, 0);
+    const char spawn[] = "spawn=";
+    const char pipebuf[] = "pipebuf=";
+    if (args.argc == 2 && strncmp(args.argv[1], spawn, sizeof(spawn) - 1) == 0) {
+        const char* value = args.argv[1] + sizeof(spawn) - 1;
+        for (int backend = SPAWN_POSIX; backend <= SPAWN_FORK; backend++) {
+            if (strcmp(value, SPAWN_BACKEND_NAMES[backend]) == 0) {
+                return new SetCommand(args.cmd_line, SET_SPAWN, backend);
+            }
+        }
+    }
+    long size;
+    if (args.argc == 2 && strncmp(args.argv[1], pipebuf, sizeof(pipebuf) - 1) == 0 &&
+        _parseSize(args.argv[1] + sizeof(pipebuf) - 1, &size)) {
+        return new SetCommand(args.cmd_line, SET_PIPEBUF, size);
+    }
+    args.err<<("smash error: set: invalid arguments")<<endl;
+    return nullptr;
+}
+
+static Command* _createHash(const BuiltinArgs &args) {
+    if (args.argc == 1) return new HashCommand(args.cmd_line, false);
+    if (args.argc == 2 && strcmp(args.argv[1], "-r") == 0) return new HashCommand(args.cmd_line, true);
+    args.err<<("smash error: hash: invalid arguments")<<endl;
+    return nullptr;
+}
+
+static Command* _createPipeStat(const BuiltinArgs &args) {
+    if (args.argc == 1) return new PipeStatCommand(args.cmd_line, false);
+    if (args.argc == 2 && strcmp(args.argv[1], "-c") == 0) return new PipeStatCommand(args.cmd_line, true);
+    args.err<<("smash error: pipestat: invalid arguments")<<endl;
+    return nullptr;
+}
+
+static Command* _createUnSetEnv(const BuiltinArgs &args) {
+    if (args.argc == 1) {
+        args.err<<("smash error: unsetenv: not enough arguments")<<endl;
+        return nullptr;
+    }
+    return new UnSetEnvCommand(args.argv, args.argc);
+}
+
+/**
+ * The builtin registry: one line per builtin, name -> factory, flags.
+ */
+#define SMASH_BUILTINS(BUILTIN) \
+    BUILTIN("alias", _createAlias, BUILTIN_DEFAULT) \
+    BUILTIN("chprompt", _createChangePrompt, BUILTIN_DEFAULT) \
+    BUILTIN("showpid", _createShowPid, BUILTIN_THREAD_SAFE | BUILTIN_BACKGROUND) \
+    BUILTIN("jobs", _createJobs, BUILTIN_THREAD_SAFE) \
+    BUILTIN("pwd", _createGetCurrDir, BUILTIN_THREAD_SAFE | BUILTIN_BACKGROUND) \
+    BUILTIN("cd", _createChangeDir, BUILTIN_DEFAULT) \
+    BUILTIN("fg", _createForeground, BUILTIN_DEFAULT) \
+    BUILTIN("bg", _createBackground, BUILTIN_DEFAULT) \
+    BUILTIN("wait", _createWait, BUILTIN_DEFAULT) \
+    BUILTIN("kill", _createKill, BUILTIN_DEFAULT) \
+    BUILTIN("whoami", _createWhoAmI, BUILTIN_THREAD_SAFE | BUILTIN_BACKGROUND) \
+    BUILTIN("unalias", _createUnAlias, BUILTIN_DEFAULT) \
+    BUILTIN("sysinfo", _createSysInfo, BUILTIN_THREAD_SAFE | BUILTIN_BACKGROUND) \
+    BUILTIN("quit", _createQuit, BUILTIN_DEFAULT) \
+    BUILTIN("du", _createDiskUsage, BUILTIN_THREAD_SAFE | BUILTIN_BACKGROUND) \
+    BUILTIN("unsetenv", _createUnSetEnv, BUILTIN_DEFAULT) \
+    BUILTIN("cmdcache", _createCmdCache, BUILTIN_DEFAULT) \
+    BUILTIN("set", _createSet, BUILTIN_DEFAULT) \
+    BUILTIN("hash", _createHash, BUILTIN_DEFAULT) \
+    BUILTIN("pipestat", _createPipeStat, BUILTIN_DEFAULT)
+
+// FNV-1a over the first len characters, usable as a case label
+constexpr unsigned int _builtinHash(const char* s, size_t len, unsigned int h = 2166136261u) {
+    return len == 0 ? h : _builtinHash(s + 1, len - 1, (h ^ (unsigned char)*s) * 16777619u);
+}
+
+/**
+ * Finds the builtin registered under name. The switch is the perfect hash:
+ * two names with the same hash would be duplicate case labels and fail to
+ * compile.
+ */
+static const BuiltinEntry* _findBuiltin(const char* name) {
+    size_t len = strlen(name);
+    const BuiltinEntry* entry;
+    switch (_builtinHash(name, len)) {
+#define BUILTIN_CASE(NAME, FACTORY, FLAGS) \
+        case _builtinHash(NAME, sizeof(NAME) - 1): { \
+            static const BuiltinEntry registered = {NAME, FACTORY, FLAGS}; \
+            entry = &registered; \
+            break; \
+        }
+        SMASH_BUILTINS(BUILTIN_CASE)
+#undef BUILTIN_CASE
+        default:
+            return nullptr;
+    }
+    if (strcmp(entry->name, name) != 0) return nullptr;
+    return entry;
+}
+
+/**
+* Creates and returns a pointer to Command class which matches the given command line (cmd_line)
+*/
+Command *SmallShell::CreateCommand(const char *cmd_line) {
+    const ParsedLine& parsedLine = parseCache.lookup(cmd_line, aliasTable);
+    if (!parsedLine.isValid()) {
+        cerr << parsedLine.getError() << endl;
+        return nullptr;
+    }
+    if (parsedLine.size() == 0) return nullptr;
+    return CreateCommand(parsedLine.pipeline(0));
+}
+
+Command *SmallShell::CreateCommand(const PipelineNode &pipeline) {
+    if (pipeline.stageCount == 1) {
+        return CreateCommand(pipeline.stages[0], pipeline.text, pipeline.background);
+    }
+    return new PipeCommand(pipeline);
+}
+
+Command *SmallShell::CreateCommand(const CommandNode &node, const char *cmd_line, bool background) {
+    Command* command = nullptr;
+    if (node.argc > 0) {
+        const BuiltinEntry* builtin = _findBuiltin(node.argv[0]);
+        if (builtin) {
+            if (node.redirectionCount) return new RedirectionCommand(builtin, node, cmd_line);
+            BuiltinArgs args = {cmd_line, node.argv, node.argc, std::cerr};
+            command = builtin->create(args);
+            if (command) {
+                command->threadSafe = builtin->flags & BUILTIN_THREAD_SAFE;
+                command->detachable = builtin->flags & BUILTIN_BACKGROUND;
+            }
+        } else {
+            command = new ExternalCommand(node, cmd_line, background);
+        }
+    }
+    if (command || node.redirectionCount == 0) return command;
+    return new RedirectionCommand(nullptr, node, cmd_line);
+}
+
+bool SmallShell::readInput() {
+    char buffer[4096];
+    ssize_t length;
+    do {
+        length = read(STDIN_FILENO, buffer, sizeof(buffer));
+    } while (length == -1 && errno == EINTR);
+    if (length <= 0) {
+        inputEnded = true;
+        return false;
+    }
+    input.append(buffer, length);
+    return true;
+}
+
+bool SmallShell::nextLine(std::string &line) {
+    size_t end = input.find('\n');
+    if (end == string::npos) {
+        if (!inputEnded || input.empty()) return false;
+        end = input.size();
+    }
+    line.assign(input, 0, end);
+    input.erase(0, std::min(end + 1, input.size()));
+    return true;
+}
+
+void SmallShell::run() {
+    JobsList *jobs = m_job_list;
+    // at a terminal, jobs are reported as soon as they finish
+    bool interactive = isatty(STDIN_FILENO);
+    // kept for the whole session, so a warm line or report costs no allocation
+    std::string cmd_line;
+    BufferSink doneSink;
+    std::ostream done(&doneSink);
+    auto prompt = [this]() {
+        std::cout << getPrompt() << "> " << std::flush;
+    };
+    auto reap = [&](bool atPrompt) {
+        doneSink.clear();
+        jobs->removeFinishedJobs(interactive ? &done : nullptr);
+        if (doneSink.str().empty()) return;
+        if (atPrompt) std::cout << '\n';
+        std::cout << doneSink.str();
+        if (atPrompt) prompt();
+    };
+    inputEnded = false;
+    eventLoop.watch(signalFd, [&]() {
+        handleSignals();
+        if (interactive) prompt();
+    });
+    eventLoop.watch(jobs->getChildFd(), [&]() { reap(true); });
+    eventLoop.watch(jobs->getWakeFd(), [&]() { reap(true); });
+    eventLoop.watch(STDIN_FILENO, [&]() {
+        readInput();
+        while (nextLine(cmd_line)) {
+            try {
+                executeCommand(cmd_line.c_str());
+            } catch(void*){
+               int i = 0;
+                i++;//some compilers ignore empty catch blocks
+            }
+            reap(false);
+            prompt();
+        }
+        if (inputEnded) eventLoop.stop();
+    });
+
+    reap(false);
+    prompt();
+    eventLoop.run();
+    eventLoop.unwatch(STDIN_FILENO);
+    eventLoop.unwatch(jobs->getWakeFd());
+    eventLoop.unwatch(jobs->getChildFd());
+    eventLoop.unwatch(signalFd);
+}
+
+bool SmallShell::readContinuation(std::string &line) {
+    // only someone typing needs it; a script's output stays as it was
+    if (isatty(STDIN_FILENO)) std::cout << "> " << std::flush;
+    while (!nextLine(line)) {
+        if (inputEnded) return false;
+        readInput();
+    }
+    return true;
+}
+
+/**
+ * Reads the bodies of the line's here-documents, in order, from the input
+ * lines that follow it, and prepares the bodies of its here-strings.
+ */
+void SmallShell::readHereDocuments(const ParsedLine &parsedLine) {
+    hereDocuments.clear();
+    for (int i = 0; i < parsedLine.size(); i++) {
+        const PipelineNode& pipeline = parsedLine.pipeline(i);
+        for (int j = 0; j < pipeline.stageCount; j++) {
+            const CommandNode& stage = pipeline.stages[j];
+            for (int k = 0; k < stage.redirectionCount; k++) {
+                const Redirection& redirection = stage.redirections[k];
+                if (redirection.type != REDIRECT_HEREDOC && redirection.type != REDIRECT_HERESTRING) continue;
+                HereDocument document = {&redirection, _unquote(redirection.target)};
+                if (redirection.type == REDIRECT_HERESTRING) {
+                    document.body.push_back('\n');
+                } else {
+                    string delimiter, line;
+                    delimiter.swap(document.body);
+                    while (readContinuation(line) && line != delimiter) {
+                        document.body += line;
+                        document.body.push_back('\n');
+                    }
+                }
+                hereDocuments.push_back(std::move(document));
+            }
+        }
+    }
+}
+
+const std::string *SmallShell::getHereDocument(const Redirection *redirection) const {
+    for (const HereDocument& document : hereDocuments) {
+        if (document.redirection == redirection) return &document.body;
+    }
+    return nullptr;
+}
+
+void SmallShell::executeCommand(const char *cmd_line) {
+    m_job_list->removeFinishedJobs();
+    const ParsedLine& parsedLine = parseCache.lookup(cmd_line, aliasTable);
+    if (!parsedLine.isValid()) {
+        cerr << parsedLine.getError() << endl;
+        return;
+    }
+    readHereDocuments(parsedLine);
+    for (int i = 0; i < parsedLine.size(); i++) {
+        const PipelineNode& pipeline = parsedLine.pipeline(i);
+        Command* cmd = CreateCommand(pipeline);
+        if (cmd && pipeline.background && cmd->detachable && m_job_list->addBuiltinJob(cmd)) continue;
+        if (cmd)
+        {
+            // a ctrl-C cancels a builtin; an external command's waiter sets foreground.pgid
+            foreground.builtin = cmd;
+            cmd->execute();
+            foreground.builtin = nullptr;
+            delete cmd;
+        }
+    }
+    // Please note that you must fork smash process for some commands (e.g., external commands....)
+}
+
+ChangePrompt::ChangePrompt(const char *prompt) : BuiltInCommand(""), prompt(prompt){
+}
+
+void ChangePrompt::execute(){
+    SmallShell& smash = SmallShell::getInstance();
+    if(*this->prompt){
+        smash.setPrompt(this->prompt);
+    }
+    else{
+        smash.setPrompt("smash");
+    }
+}
+
+PipeSink::PipeSink(int fd, PipeStats *stats) : fd(fd), stats(stats) {
+    int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+    splicing = pipe_size > 0;
+    if (splicing) {
+        while (chunkSize < (size_t) pipe_size) chunkSize *= 2;
+    }
+    nextChunk();
+}
+
+PipeSink::~PipeSink() {
+    flush();
+    if (chunk) munmap(chunk, chunkSize);
+}
+
+/**
+ * Starts a new chunk once the last one was handed over. A chunk that went
+ * through write() is reused; a spliced one is unmapped, which leaves its
+ * pages to the pipe, and replaced by fresh pages.
+ */
+bool PipeSink::nextChunk() {
+    if (chunk && splicing) {
+        munmap(chunk, chunkSize);
+        chunk = nullptr;
+    }
+    if (!chunk) {
+        void *mapped = mmap(nullptr, chunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            setp(nullptr, nullptr);
+            failed = true;
+            return false;
+        }
+        chunk = static_cast<char *>(mapped);
+    }
+    setp(chunk, chunk + chunkSize);
+    return true;
+}
+
+/**
+ * Hands [pbase, pptr) to the pipe. After a splice the bytes must stay
+ * untouched, so writing resumes after them, and the chunk is not reused.
+ */
+bool PipeSink::flush() {
+    char *begin = pbase();
+    char *end = pptr();
+    while (begin < end && !failed) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        if (poll(&pfd, 1, 0) == 0) {
+            if (stats) __sync_fetch_and_add(&stats->writerBlocks, 1);
+            poll(&pfd, 1, -1);
+        }
+        ssize_t moved;
+        if (splicing) {
+            struct iovec iov = {begin, (size_t) (end - begin)};
+            moved = vmsplice(fd, &iov, 1, SPLICE_F_NONBLOCK | SPLICE_F_GIFT);
+            if (moved == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                splicing = false;
+                continue;
+            }
+        } else {
+            moved = write(fd, begin, end - begin);
+        }
+        if (moved == -1) {
+            if (errno != EINTR && errno != EAGAIN) failed = true;
+            continue;
+        }
+        begin += moved;
+    }
+    setp(end, epptr());
+    return !failed;
+}
+
+PipeSink::int_type PipeSink::overflow(int_type ch) {
+    if (!flush() || !nextChunk()) return traits_type::eof();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+int PipeSink::sync() {
+    return failed ? -1 : 0;
+}
+
+FdSink::FdSink(int fd) : fd(fd) {
+    setp(buffer, buffer + sizeof(buffer));
+}
+
+FdSink::~FdSink() {
+    flush();
+}
+
+bool FdSink::flush() {
+    char *begin = pbase();
+    while (begin < pptr() && !failed) {
+        ssize_t written = write(fd, begin, pptr() - begin);
+        if (written == -1) {
+            if (errno != EINTR) failed = true;
+            continue;
+        }
+        begin += written;
+    }
+    setp(buffer, buffer + sizeof(buffer));
+    return !failed;
+}
+
+FdSink::int_type FdSink::overflow(int_type ch) {
+    if (!flush()) return traits_type::eof();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+int FdSink::sync() {
+    return flush() ? 0 : -1;
+}
+
+BufferSink::int_type BufferSink::overflow(int_type ch) {
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) buffer.push_back(traits_type::to_char_type(ch));
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize BufferSink::xsputn(const char *data, std::streamsize count) {
+    buffer.append(data, count);
+    return count;
+}
+
+void *CommandPool::freeLists[CommandPool::CLASSES];
+
+void *CommandPool::allocate(size_t size) {
+    size_t index = (size + GRANULE - 1) / GRANULE;
+    if (index >= CLASSES) return ::operator new(size);
+    void *block = freeLists[index];
+    if (!block) return ::operator new(index * GRANULE);
+    freeLists[index] = *static_cast<void **>(block);
+    return block;
+}
+
+void CommandPool::release(void *ptr, size_t size) {
+    size_t index = (size + GRANULE - 1) / GRANULE;
+    if (!ptr) return;
+    if (index >= CLASSES) {
+        ::operator delete(ptr);
+        return;
+    }
+    *static_cast<void **>(ptr) = freeLists[index];
+    freeLists[index] = ptr;
+}
+
+Command::Command(const char *cmd_line, pid_t pid) : currentPID(pid), cmdLine(cmd_line), output(&std::cout),
+    errors(&std::cerr) {}
+
+Command::~Command() = default;
+
+bool Command::isCancelled() const {
+    if (!cancelled) SmallShell::getInstance().pollSignals();
+    return cancelled != 0;
+}
+
+static void _applyStageIo(const StageIo &io) {
+    sigset_t signals;
+    _shellSignals(&signals);
+    sigprocmask(SIG_UNBLOCK, &signals, nullptr);
+    if (io.input != -1) dup2(io.input, STDIN_FILENO);
+    if (io.output != -1) dup2(io.output, io.outputFd);
+    if (io.input != -1) close(io.input);
+    if (io.output != -1) close(io.output);
+    if (io.close != -1) close(io.close);
+    for (int i = 0; i < io.actionCount; i++) {
+        const FdAction& action = io.actions[i];
+        if (action.source == -1) close(action.fd);
+        else if (action.source == action.fd) fcntl(action.fd, F_SETFD, 0);
+        else dup2(action.source, action.fd);
+    }
 }
 
+pid_t Command::start(const StageIo &io) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("smash error: fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        setpgid(0, io.pgid);
+        _applyStageIo(io);
+        struct stat sb;
+        if (io.output != -1 && io.outputFd == STDOUT_FILENO &&
+            fstat(STDOUT_FILENO, &sb) == 0 && S_ISFIFO(sb.st_mode)) {
+            PipeSink sink(STDOUT_FILENO, SmallShell::getInstance().getPipeStats());
+            std::ostream stream(&sink);
+            setOutput(&stream);
+            execute();
+            stream.flush();
+            setOutput(&cout);
+        } else {
+            execute();
+        }
+        // _exit: the static destructors would join the shell's worker
+        // threads, which do not exist in the child
+        cout.flush();
+        cerr.flush();
+        fflush(nullptr);
+        _exit(0);
+    }
+    setpgid(pid, io.pgid ? io.pgid : pid);
+    return pid;
+}
 
 /**
-* Creates and returns a pointer to Command class which matches the given command line (cmd_line)
-*/
-Command *SmallShell::CreateCommand(const char *cmd_line) {
-    char* args[COMMAND_MAX_ARGS];
-    char** argv = args;
-    //char* original_comman_line = strdup(cmd_line);
-    bool is_alias = false;
-    string new_command_line;
-    const char* new_command_line_ptr = nullptr;
-    int argc = _parseCommandLine(cmd_line, argv);
-    if (_trim(string(cmd_line)).empty()) return nullptr;
-    //NEED TO UPDATE WHERE TO SEND ORIGINAL_COMMAND_LINE////////
-    string clean_line = string(cmd_line);
-    clean_line = _trim(clean_line);
-     // cout <<clean_line<<endl;
-    for (auto& pair : this->aliasVector)
-    {
-        if (pair.first.compare(string(argv[0])) == 0) {
-            is_alias = true;
-            new_command_line = pair.second;
-            for (int i = 1; i < argc; ++i) {
-                new_command_line += " ";
-                new_command_line += argv[i];
-                free(argv[i]);
-            }
-            if (argv[0] != nullptr) free(argv[0]);
-            new_command_line_ptr = new_command_line.c_str();
-            char* strPtr = strdup(new_command_line_ptr);
-            argc = _parseCommandLine(strPtr, argv);
-            free(strPtr);
-            break;
+ * Starts the file at path with argv in the process group and with the
+ * streams given by io. posix_spawn and vfork report a failed exec to the parent: -1 is
+ * returned with errno set. With fork the child reports it and exits with 1.
+ */
+static pid_t _spawn(SpawnBackend backend, const char* path, char** argv, const StageIo &io) {
+    pid_t pid = -1;
+    if (backend == SPAWN_POSIX) {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+        sigset_t signals, mask;
+        _shellSignals(&signals);
+        pthread_sigmask(SIG_BLOCK, nullptr, &mask);
+        for (int signum = 1; signum < NSIG; signum++) {
+            if (sigismember(&signals, signum) == 1) sigdelset(&mask, signum);
         }
-    }
-    if (string(argv[0]).compare("alias") == 0) {
-        // for (int i = 0; i < argc; i++) {
-        //     free(argv[i]);
-        // }
-        return new AliasCommand((clean_line + '\0').c_str());
-    }
-    string command_to_check = is_alias ? (new_command_line) : string(cmd_line);
-    for (unsigned int i = 0; i < command_to_check.size() - 1 ; i++){
-        if (command_to_check[i] == '>' && command_to_check[i+1] == '>')
-        {
-            int command_end = command_to_check.find_last_of('>');
-            string command = command_to_check.substr(0, command_end - 1);
-            string path = command_to_check.substr(command_end + 1, std::string::npos);
-            // for (int i = 0; i < argc; i++) {
-            //     free(argv[i]);
-            // }
-            return new RedirectionCommand(command,path, true, false);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&attr, io.pgid);
+        posix_spawnattr_setsigmask(&attr, &mask);
+        if (io.input != -1) posix_spawn_file_actions_adddup2(&actions, io.input, STDIN_FILENO);
+        if (io.output != -1) posix_spawn_file_actions_adddup2(&actions, io.output, io.outputFd);
+        if (io.close != -1) posix_spawn_file_actions_addclose(&actions, io.close);
+        for (int i = 0; i < io.actionCount; i++) {
+            const FdAction& action = io.actions[i];
+            if (action.source == -1) posix_spawn_file_actions_addclose(&actions, action.fd);
+            else posix_spawn_file_actions_adddup2(&actions, action.source, action.fd);
         }
-    }
-    for (const char &ch : command_to_check) {
-        if (ch == '>') {
-            int command_end = command_to_check.find_first_of(ch);
-            string command = command_to_check.substr(0, command_end);
-            string path = command_to_check.substr(command_end + 1, std::string::npos);
-            // for (int i = 0; i < argc; i++) {
-            //     free(argv[i]);
-            // }
-            return new RedirectionCommand(command,path, false, true);
+        int error = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        if (error) {
+            errno = error;
+            return -1;
         }
-    }
+        return pid;
+    }
+    if (backend == SPAWN_VFORK) {
+        // the child borrows our memory until it execs, so it can hand back errno
+        volatile int exec_error = 0;
+        pid = vfork();
+        if (pid == 0) {
+            setpgid(0, io.pgid);
+            _applyStageIo(io);
+            execv(path, argv);
+            exec_error = errno;
+            _exit(127);
+        }
+        if (pid > 0 && exec_error) {
+            waitpid(pid, nullptr, 0);
+            errno = exec_error;
+            return -1;
+        }
+        return pid;
+    }
+    pid = fork();
+    if (pid == 0) {
+        setpgid(0, io.pgid);
+        _applyStageIo(io);
+        execv(path, argv);
+        perror("smash error: execvp failed");
+        _exit(1);
+    }
+    if (pid > 0) setpgid(pid, io.pgid ? io.pgid : pid);
+    return pid;
+}
 
+BuiltInCommand::BuiltInCommand(const char *cmd_line) : Command(cmd_line) {
+}
 
-    if (argc == 0) return nullptr;
+KillCommand::KillCommand(const char *cmd_line, int signum, int job_id): BuiltInCommand(cmd_line),
+    signum_to_send(signum), job_id(job_id) {}
 
-    for (const char &ch : is_alias ? string(new_command_line_ptr) : string(cmd_line)) {
-        if (ch == '|') {
-            // for (int i = 0; i < argc; i++) {
-            //     free(argv[i]);
-            // }
-            if (is_alias) return new PipeCommand(new_command_line_ptr);
-            return new PipeCommand((clean_line + '\0').c_str());
-        }
-    }
-    if (string(argv[0]).compare("chprompt") == 0) {
-        if(argc == 1) return new ChangePrompt("");
-        // if (argc > 2) {
-        //     for (int i = 2; i< argc ; i++)
-        //         free(argv[i]);
-        // }
-        free(argv[0]);
-        return new ChangePrompt(argv[1]);
+void KillCommand::execute() {
+    JobsList::JobEntry* job_to_signal = SmallShell::getInstance().getJobList()->getJobById(job_id);
+    if (!job_to_signal) {
+        string to_throw = "smash error: kill: job-id " + std::to_string(job_id) + " does not exist";
+        err() << (to_throw.c_str()) << endl;
+        return;
     }
-
-    if (string(argv[0]).compare("showpid") == 0 || string(argv[0]).compare("showpid&") == 0) {
-        // for (int i = 0; i < argc; i++) {
-        //     free(argv[i]);
-        // }
-      return new ShowPidCommand((clean_line + '\0').c_str());
+    pid_t pid_of_job = job_to_signal->getPid();
+    if (!job_to_signal->sendSignal(signum_to_send)) {
+        _perror(err(), "smash error: kill failed");
+        return;
     }
-
-    if (string(argv[0]).compare("jobs") == 0 || string(argv[0]).compare("jobs&") == 0) {
-        // for (int i = 0; i < argc; i++) {
-        //     free(argv[i]);
-        // }
-        return new JobsCommand((clean_line + '\0').c_str());
+    if (job_to_signal->getBuiltin()) {
+        out() << "signal number " << signum_to_send << " was sent to job-id " << job_id << endl;
+        return;
     }
+    out() << "signal number " <<signum_to_send<< " was sent to pid " << pid_of_job << endl;
+}
 
-    if (string(argv[0]).compare("pwd") == 0 || string(argv[0]).compare("pwd&") == 0) {
-        // for (int i = 0; i < argc; i++) {
-        //     free(argv[i]);
-        // }
-        return new GetCurrDirCommand((clean_line + '\0').c_str());
-    }
 
-    if (string(argv[0]).compare("cd") == 0 ) {
 
-        if (argc > 2){
-            if (string(argv[2]).compare("&") == 0)
-                if (argc == 3) {
-                    // free(argv[2]);
-                    // free(argv[0]);
-                    return new ChangeDirCommand(argv[1]);
-                }
-            cerr<<("smash error: cd: too many arguments")<<endl;
-            return  nullptr;
-        }
-        else if (argv[1] != nullptr)
-        {
-            return new ChangeDirCommand(argv[1]);
-        }
-    }
+ExternalCommand::ExternalCommand(const CommandNode &node, const char *cmd_line, bool background) :
+    Command(cmd_line), argv(node.argv), am_i_in_background(background), redirections(node.redirections),
+    redirectionCount(node.redirectionCount) {
+    am_i_complex = GlobExpansion::needed(node.argv);
+}
 
-    string line = cmd_line;
-    for (auto ch: line) {
-        if(ch == '|') {
-            // for (int i = 0; i < argc; i++) {
-            //     free(argv[i]);
-            // }
-            return new PipeCommand((clean_line + '\0').c_str());
+/**
+ * Matches a bracket expression starting at p ('[') against ch. Returns false
+ * if the bracket is not closed before p_end, in which case '[' is literal.
+ */
+static bool _matchBracket(const char *p, const char *p_end, char ch, const char **end, bool *matched) {
+    const char *q = p + 1;
+    bool negate = q < p_end && (*q == '!' || *q == '^');
+    if (negate) q++;
+    bool found = false;
+    bool first = true;
+    while (q < p_end && (first || *q != ']')) {
+        first = false;
+        char low = *q;
+        if (low == '\\' && q + 1 < p_end) low = *++q;
+        q++;
+        char high = low;
+        if (q + 1 < p_end && *q == '-' && q[1] != ']') {
+            q++;
+            high = *q;
+            if (high == '\\' && q + 1 < p_end) high = *++q;
+            q++;
         }
+        if ((unsigned char) low <= (unsigned char) ch && (unsigned char) ch <= (unsigned char) high) found = true;
     }
+    if (q >= p_end) return false;
+    *end = q + 1;
+    *matched = found != negate;
+    return true;
+}
 
-    if (string(argv[0]).compare("fg") == 0) {
-        if (argc > 2){
-            if (argc > 3) {
-                // for (int i = 0; i < argc; i++) {
-                //     free(argv[i]);
-                // }
-                cerr<<("smash error: fg: invalid arguments")<<endl;
-                return  nullptr;
+/**
+ * Matches name against the pattern [p, p_end), where a backslash makes the
+ * next character literal. Backtracks to the last '*' instead of recursing.
+ */
+static bool _globMatch(const char *p, const char *p_end, const char *name) {
+    const char *star = nullptr;
+    const char *star_name = nullptr;
+    while (*name) {
+        if (p < p_end) {
+            char c = *p;
+            const char *end;
+            bool matched;
+            if (c == '*') {
+                star = ++p;
+                star_name = name;
+                continue;
             }
-            ssize_t idx = string(argv[2]).find_first_not_of(' ');
-            string last_arg = string(argv[2]).substr(idx, idx+1);
-            if (last_arg.compare("&") == 0 || argc == 2) {
-                char *c = argv[1];
-                string num;
-                while (*c != '\0') {
-                    if ((WHITESPACE.find(c) == false) && (*c != '&') && (*c < '0' || *c > 9)) {
-                        cerr<<("smash error: fg: invalid arguments")<<endl;
-                        return nullptr;
-                    }
-                    if (*c != '&') {
-                        num += *c;
-                    }
-                    c++;
-                }
-                int num_id = stoi(num);
-                if (num_id < 0) {
-                    string to_throw = "smash error: fg: job-id "+std::to_string(num_id)+" does not exist";
-                    cerr<<(to_throw.c_str())<<endl;
-                    return nullptr;
-                }
-                // string clean_line = string(qcmd_line);
-                // clean_line = _trim(clean_line);
-                // return new ForegroundCommand(clean_line.c_str(), num_id);
-                return  new ForegroundCommand((clean_line + '\0').c_str(), num_id);
+            if (c == '?') {
+                p++;
+                name++;
+                continue;
             }
-        }
-        if (argc == 2) {
-            int num_id = 1;
-            string num;
-            for (auto ch: string(argv[1])) {
-                if (WHITESPACE.find(ch) == false && ch < '1' || ch > '9') {
-                    cerr<<("smash error: fg: invalid arguments")<<endl;
-                    return nullptr;
+            if (c == '[' && _matchBracket(p, p_end, *name, &end, &matched)) {
+                if (matched) {
+                    p = end;
+                    name++;
+                    continue;
                 }
-                else {
-                    num += ch;
+            } else {
+                if (c == '\\' && p + 1 < p_end) c = *++p;
+                if (c == *name) {
+                    p++;
+                    name++;
+                    continue;
                 }
             }
-           num_id = stoi(num);
-            if (!SmallShell::getJobList()->getJobById(num_id)) {
-                string to_throw = "smash error: fg: job-id "+std::to_string(num_id)+" does not exist";
-                cerr<<(to_throw.c_str())<<endl;
-                return nullptr;
-            }
-            // string clean_line = string(cmd_line);
-            // clean_line = _trim(clean_line);
-            // return new ForegroundCommand(clean_line.c_str(), num_id);
-            return new ForegroundCommand(cmd_line, num_id);
-        }
-        // string clean_line = string(cmd_line);
-        // clean_line = _trim(clean_line);
-        // return new ForegroundCommand(clean_line.c_str());
-        return new ForegroundCommand(cmd_line);
-    }
-    // string clean_line = string(cmd_line);
-    // clean_line = _trim(clean_line);
-    if (string(argv[0]).compare("kill") == 0) {
-        return new KillCommand(cmd_line, m_job_list);
-    }
-    if (string(argv[0]).compare("whoami") == 0) {
-        return new WhoAmICommand(cmd_line);
-    }
-    if (string(argv[0]).compare("unalias") == 0) {
-        return new UnAliasCommand(cmd_line);
-    }
-    if (string(argv[0]).compare("sysinfo") == 0) {
-        return new SysInfoCommand(cmd_line);
-    }
-    if (string(argv[0]).compare("quit") == 0) {
-        if(argv[1] && string(argv[1]).compare("kill") == 0)
-            return new QuitCommand(cmd_line, this->m_job_list, true);
-        return new QuitCommand(cmd_line, this->m_job_list, false);
-    }
-    if (string(argv[0]).compare("du") == 0) {
-        if (argc > 2) {
-            cerr<<("smash error: du: too many arguments")<<endl;
-            return nullptr;
-        }
-        if (argc == 2) return new DiskUsageCommand(cmd_line, string(argv[1]));
-        if (argc == 1)
-        {
-            // string clean_line = string(cmd_line);
-            // clean_line = _trim(clean_line);
-            return new DiskUsageCommand(cmd_line, "./");
         }
+        if (!star) return false;
+        p = star;
+        name = ++star_name;
     }
-    if (string(argv[0]).compare("unsetenv") == 0) {
-        if (argc == 1) {
-            cerr<<("smash error: unsetenv: not enough arguments")<<endl;
-            return nullptr;
-        }
-        // string clean_line = string(cmd_line);
-        // clean_line = _trim(clean_line);
-        return new UnSetEnvCommand(cmd_line);
-    }
-
-    if(is_alias){
-        const char* new_command_line_ptr = new_command_line.c_str();
-        // char* newStr = strdup(new_command_line_ptr);
-        // string clean_line = string(newStr);
-        // clean_line = _trim(clean_line.c_str());
-        return new ExternalCommand(cmd_line);
-    }
-    return new ExternalCommand(clean_line.c_str());
+    while (p < p_end && *p == '*') p++;
+    return p == p_end;
 }
 
-void SmallShell::executeCommand(const char *cmd_line) {
-    Command* cmd =CreateCommand(cmd_line);
-    if (cmd)
-    {
-        cmd->execute();
-        delete cmd;
-        return;
+static bool _hasGlob(const char *p, const char *p_end) {
+    for (; p < p_end; p++) {
+        const char *end;
+        bool matched;
+        if (*p == '\\') p++;
+        else if (*p == '*' || *p == '?') return true;
+        else if (*p == '[' && _matchBracket(p, p_end, '\0', &end, &matched)) return true;
     }
-    // Please note that you must fork smash process for some commands (e.g., external commands....)
+    return false;
 }
 
-ChangePrompt::ChangePrompt(std::string const& prompt) : BuiltInCommand(""){
-    this->prompt = prompt;
+bool GlobExpansion::needed(char **argv) {
+    for (char **arg = argv; *arg; arg++) {
+        if (strpbrk(*arg, "*?[")) return true;
+    }
+    return false;
 }
 
-void ChangePrompt::execute(){
-    SmallShell& smash = SmallShell::getInstance();
-    if(this->prompt.compare("")){
-        smash.setPrompt(this->prompt);
+char **GlobExpansion::expand(char **words_in) {
+    buffer.clear();
+    words.clear();
+    for (char **arg = words_in; *arg; arg++) {
+        expandWord(*arg);
     }
-    else{
-        smash.setPrompt("smash");
+    argv.clear();
+    for (size_t offset : words) {
+        argv.push_back(&buffer[offset]);
     }
+    argv.push_back(nullptr);
+    return argv.data();
 }
 
-Command::~Command() = default;
-
-BuiltInCommand::BuiltInCommand(const char *cmd_line) : Command(cmd_line) {
-    cmd_to_print = std::string(cmd_line);
-    if (cmd_to_print.size() < 2)
+/**
+ * Appends the expansion of one word: its matches in sorted order, or the
+ * word itself with quotes removed. In the pattern, quoted characters and
+ * literal backslashes are escaped so that they never act as wildcards.
+ */
+void GlobExpansion::expandWord(const char *word) {
+    size_t literal = buffer.size();
+    pattern.clear();
+    char quote = '\0';
+    for (const char *c = word; *c; c++) {
+        if (quote && *c == quote) {
+            quote = '\0';
+            continue;
+        }
+        if (!quote && (*c == '\'' || *c == '"')) {
+            quote = *c;
+            continue;
+        }
+        buffer.push_back(*c);
+        if ((quote && strchr("*?[\\", *c)) || (!quote && *c == '\\')) pattern.push_back('\\');
+        pattern.push_back(*c);
+    }
+    buffer.push_back('\0');
+    size_t first = words.size();
+    if (_hasGlob(pattern.data(), pattern.data() + pattern.size())) {
+        path.clear();
+        match(0);
+    }
+    if (words.size() == first) {
+        words.push_back(literal);
         return;
-   cmdLine = string(cmd_line);
-    for (auto &ch: cmdLine) {
-        if (ch == '&')
-            ch = (char)(20);
     }
+    std::sort(words.begin() + first, words.end(), [this](size_t a, size_t b) {
+        return strcmp(&buffer[a], &buffer[b]) < 0;
+    });
 }
 
-KillCommand::KillCommand(const char *cmd_line, JobsList *jobs): BuiltInCommand(cmd_line) {
-    cmdLine = _trim(cmdLine);
-    std::vector<string> args;
-    string segment;
-    for (auto ch:cmdLine) {
-        if (WHITESPACE.find(ch) == false) {
-            segment += ch;
+/**
+ * Expands the pattern components from position on, below the directory
+ * prefix held in path. Components without wildcards are taken as they are.
+ */
+void GlobExpansion::match(size_t position) {
+    size_t slash = pattern.find('/', position);
+    size_t end = slash == string::npos ? pattern.size() : slash;
+    size_t path_length = path.size();
+    const char *p = pattern.data() + position;
+    const char *p_end = pattern.data() + end;
+    if (!_hasGlob(p, p_end)) {
+        for (; p < p_end; p++) {
+            if (*p == '\\') p++;
+            path.push_back(*p);
+        }
+        if (slash == string::npos) {
+            struct stat sb;
+            if (lstat(path.c_str(), &sb) == 0) addMatch();
         } else {
-            args.push_back(segment);
-            segment.clear();
+            path.push_back('/');
+            match(slash + 1);
         }
+        path.resize(path_length);
+        return;
     }
-    if (args.size() > 2) {
-        if (args[1][0] != '-' || args[1].size() > 3) {
-            cerr << ("smash error: kill: invalid arguments") << endl;
-            throw;
-        }
-        string signum;
-        unsigned int i = 1;
-        while (i < args[1]. size() - 1) {
-            signum += args[1][i];
-            i++;
-        }
-        if (args[1][i] != '&') {
-            signum+= args[1][i];
-        }
-        signum_to_send = stoi(signum);
-        string jobID;
-        i = 0;
-        while (i < args[2].size() - 1) {
-            if (args[2][i] < '0' || args[2][i] > '9') {
-                cerr << ("smash error: kill: invalid arguments") << endl;
-                throw;
-            }
-            jobID += args[2][i];
-            i++;
-        }
-        if (args[2][i] == '&') {
-            job_id = stoi(jobID);
-            return;
+    DIR *dir = opendir(path.empty() ? "." : path.c_str());
+    if (!dir) return;
+    bool dot = *p == '.' || (*p == '\\' && p[1] == '.');
+    while (struct dirent *entry = readdir(dir)) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (!dot || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) continue;
+        if (!_globMatch(p, p_end, name)) continue;
+        path.append(name);
+        if (slash == string::npos) {
+            addMatch();
+        } else {
+            path.push_back('/');
+            match(slash + 1);
         }
-        if (args[2][i] < '0' || args[2][i] > '9') {
-            cerr << ("smash error: kill: invalid arguments") << endl;
-            throw;
+        path.resize(path_length);
+    }
+    closedir(dir);
+}
+
+void GlobExpansion::addMatch() {
+    words.push_back(buffer.size());
+    buffer.insert(buffer.end(), path.begin(), path.end());
+    buffer.push_back('\0');
+}
+
+/**
+ * Returns a descriptor reading body: a pipe when the body fits in the pipe
+ * buffer, so that writing it cannot block, and an in-memory file otherwise.
+ * Neither touches the filesystem.
+ */
+static int _openHereDocument(const std::string &body, std::ostream &err) {
+    int fds[2];
+    if (body.size() <= HEREDOC_PIPE_LIMIT && pipe2(fds, O_CLOEXEC) == 0) {
+        if (body.size() <= (size_t) fcntl(fds[1], F_GETPIPE_SZ) && _writeAll(fds[1], body.data(), body.size())) {
+            close(fds[1]);
+            return fds[0];
         }
-        jobID += args[2][i];
-        job_id = stoi(jobID);
-        return;
+        close(fds[0]);
+        close(fds[1]);
+    }
+    int fd = memfd_create("smash-heredoc", MFD_CLOEXEC);
+    if (fd == -1) {
+        _perror(err, "smash error: memfd_create failed");
+        return -1;
     }
-    cerr << ("smash error: kill: invalid arguments") << endl;
-    throw;
+    if (!_writeAll(fd, body.data(), body.size()) || lseek(fd, 0, SEEK_SET) == -1) {
+        _perror(err, "smash error: write failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-void KillCommand::execute() {
-    JobsList::JobEntry* job_to_signal = SmallShell::getInstance().getJobList()->getJobById(job_id);
-    if (!job_to_signal) {
-        string to_throw;
-        to_throw += "smash error: kill: job-id ";
-        to_throw[to_throw.size() - 2] = (char)('0' + job_id);
-        to_throw += " does not exist";
-        cerr << (to_throw.c_str()) << endl;
-        return;
+static int _openRedirection(const Redirection &redirection, std::ostream &err) {
+    if (redirection.type == REDIRECT_HEREDOC || redirection.type == REDIRECT_HERESTRING) {
+        const std::string* body = SmallShell::getInstance().getHereDocument(&redirection);
+        return _openHereDocument(body ? *body : string(), err);
     }
-    if (signum_to_send < 0 || signum_to_send > 31) {
-        cerr << ("smash error: kill: invalid arguments") << endl;
-        return;;
+    int flags = O_CLOEXEC;
+    switch (redirection.type) {
+        case REDIRECT_INPUT: flags |= O_RDONLY; break;
+        case REDIRECT_APPEND: flags |= O_WRONLY | O_CREAT | O_APPEND; break;
+        default: flags |= O_WRONLY | O_CREAT | O_TRUNC; break;
     }
-    pid_t pid_of_job = job_to_signal->getPid();
-    kill (pid_of_job, signum_to_send);
-    cout << "signal number " <<signum_to_send<< " was sent to pid " << pid_of_job;
+    int fd = open(redirection.target, flags, 0644);
+    if (fd == -1) _perror(err, "smash error: open failed");
+    return fd;
 }
 
+/** Parses the M of N>&M: a descriptor, or -1 for "-". */
+static bool _duplicateSource(const char *target, int *source) {
+    if (strcmp(target, "-") == 0) {
+        *source = -1;
+        return true;
+    }
+    return _parseNumber(target, source);
+}
 
+/**
+ * Opens the files of a command's redirections and turns the redirections,
+ * in order, into descriptor actions for the child. Opened descriptors are
+ * added to opened and must be closed by the caller once the child started.
+ */
+static bool _resolveRedirections(const Redirection *redirections, int count, std::vector<FdAction> &actions,
+                                 std::vector<int> &opened, std::ostream &err) {
+    actions.clear();
+    for (int i = 0; i < count; i++) {
+        const Redirection& redirection = redirections[i];
+        FdAction action = {redirection.fd, -1};
+        if (redirection.type == REDIRECT_DUPLICATE) {
+            bool valid = _duplicateSource(redirection.target, &action.source);
+            if (valid && action.source > STDERR_FILENO && fcntl(action.source, F_GETFD) == -1) {
+                valid = false;
+                for (const FdAction& earlier : actions) {
+                    if (earlier.fd == action.source) valid = true;
+                }
+            }
+            if (!valid) {
+                errno = EBADF;
+                _perror(err, "smash error: dup2 failed");
+                return false;
+            }
+        } else {
+            action.source = _openRedirection(redirection, err);
+            if (action.source == -1) return false;
+            // keep the file clear of descriptors the child is about to replace
+            for (int j = 0; j < count; j++) {
+                if (redirections[j].fd == action.source) {
+                    int moved = fcntl(action.source, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+                    close(action.source);
+                    action.source = moved;
+                    break;
+                }
+            }
+            if (action.source == -1) {
+                _perror(err, "smash error: fcntl failed");
+                return false;
+            }
+            opened.push_back(action.source);
+        }
+        actions.push_back(action);
+    }
+    return true;
+}
 
-ExternalCommand::ExternalCommand(const char* cmd_line) : Command(cmd_line) {
-    this ->cmd_to_print = std::string(cmd_line);
-    bool first_AND = true;
-    for (auto &ch: cmdLine) {
-        if (ch == '*' || ch == '?')
-            am_i_complex = true;
-        if (ch == '&' && first_AND) {
-            am_i_in_background = true;
-            ch = ' ';
-            first_AND = false;
+/**
+ * Redirections are applied by the child: the shell only opens the files
+ * (close-on-exec) and the child duplicates them into place.
+ */
+pid_t ExternalCommand::start(const StageIo &io) {
+    SmallShell& smash = SmallShell::getInstance();
+    SpawnBackend backend = smash.getSpawnBackend();
+    StageIo stage_io = io;
+    pid_t pid = -1;
+    if (_resolveRedirections(redirections, redirectionCount, actions, opened, err())) {
+        stage_io.actions = actions.data();
+        stage_io.actionCount = (int) actions.size();
+        char** args = am_i_complex ? glob.expand(argv) : argv;
+        const char* path = smash.getPathCache().find(args[0]);
+        if (!path) {
+            errno = ENOENT;
+            perror("smash error: execvp failed");
+        } else {
+            pid = _spawn(backend, path, args, stage_io);
+            if (pid == -1 && errno == ENOENT) smash.getPathCache().forget(args[0]);
+            if (pid == -1) {
+                perror(backend == SPAWN_FORK ? "smash error: fork failed" : "smash error: execvp failed");
+            }
         }
     }
+    for (int fd : opened) {
+        close(fd);
+    }
+    opened.clear();
+    return pid;
 }
 
 void ExternalCommand::execute() {
-    unsigned int ssize = this->getCmdLine().size() + 1;
-    char* cpy_line = (char*)malloc(ssize * sizeof(char));
-   for (unsigned int i = 0; i < ssize - 1; i++) {
-       cpy_line[i] = this->getCmdLine()[i];
-   }
-    cpy_line[ssize - 1] = '\0';
-    pid_t pid1 = fork();
+    pid_t pid1 = start(StageIo());
     if (pid1 == -1) {
-        free(cpy_line);
-        perror("smash error: fork failed");
         return;
     }
-    if (pid1 == 0) { // child proccess
-        setpgrp();
-        if (am_i_complex) {
-            char bash_path[] = "/bin/bash";
-            char flag[] = "-c";
-            char* args[] = { bash_path, flag, cpy_line, nullptr };
-            execv(bash_path, args);
-            perror("smash error: execv failed");
-            exit(1); // if we got here, the execv FAILED
-        } else {
-            char* bash_args[20]; // Assuming max 20 args per requirements
-            int i = 0;
-            char* token = strtok(cpy_line, " \t\n");
-            while (token != nullptr && i < 19) {
-                bash_args[i++] = token;
-                token = strtok(nullptr, " \t\n");
-            }
-            bash_args[i] = nullptr;
-            execvp(bash_args[0], bash_args);
-            perror("smash error: execvp failed");
-        }
-    } else {//parent proccess
-        free(cpy_line);
-        if (am_i_in_background) {
-            SmallShell::getInstance().getJobList()->addJob(this, pid1);
-        }
-        else {
-            SmallShell::getInstance().pid_of_foreGround = pid1;
-            waitpid(pid1, nullptr, 0);
-        }
+    if (am_i_in_background) {
+        SmallShell::getInstance().getJobList()->addJob(this, pid1);
+    }
+    else {
+        SmallShell& smash = SmallShell::getInstance();
+        smash.foreground.pgid = pid1;
+        smash.foreground.stoppable = true;
+        int status = 0;
+        _waitForeground(pid1, &status, nullptr);
+        smash.foreground = SmallShell::Foreground();
+        if (WIFSTOPPED(status)) smash.getJobList()->addJob(this, pid1, true);
     }
 }
 
@@ -640,7 +2297,7 @@ ShowPidCommand::ShowPidCommand(const char* cmd_line) : BuiltInCommand(""){
 }
 
 void ShowPidCommand::execute(){
-    std::cout << "smash pid is " << getpid() << std::endl;
+    out() << "smash pid is " << getpid() << std::endl;
 }
 
 GetCurrDirCommand::GetCurrDirCommand(const char* cmd_line) : BuiltInCommand(""){
@@ -649,150 +2306,122 @@ GetCurrDirCommand::GetCurrDirCommand(const char* cmd_line) : BuiltInCommand(""){
 void GetCurrDirCommand::execute(){
     char buffer[PATH_MAX];
     if (!getcwd(buffer, sizeof(buffer))){
-        perror("smash error: getcwd failed");
+        _perror(err(), "smash error: getcwd failed");
         return;
     }
-    cout << buffer << endl;
+    out() << buffer << endl;
 }
 
 
-ChangeDirCommand::ChangeDirCommand(char* path) : BuiltInCommand("") , moveTo(path){
+ChangeDirCommand::ChangeDirCommand(const char* path) : BuiltInCommand("") , moveTo(path){
 }
 
 void ChangeDirCommand::execute()
 {
     SmallShell &smash = SmallShell::getInstance();
     char* prevPath = *smash.getPreviousDirPtr();
-    if (!prevPath && string(moveTo).compare("-") == 0)
+    if (!prevPath && strcmp(moveTo, "-") == 0)
     {
-        perror("smash error: cd: OLDPWD not set");
+        _perror(err(), "smash error: cd: OLDPWD not set");
         return;
     }
     char* old_cwd = getcwd(nullptr, 0);
     if (!old_cwd) {
-        perror("smash error: getcwd failed");
+        _perror(err(), "smash error: getcwd failed");
         return;
     }
-    if (prevPath != nullptr && string(moveTo).compare("-") == 0)
+    smash.setPreviousDirPtr(old_cwd);
+    if (prevPath != nullptr && strcmp(moveTo, "-") == 0)
     {
-        moveTo = prevPath;
-        smash.setPreviousDirPtr(old_cwd);
-        chdir(moveTo);
+        chdir(prevPath);
     }
     else
     {
-        smash.setPreviousDirPtr(old_cwd);
         chdir(moveTo);
     }
+    free(prevPath);
 }
 
 
-AliasCommand::AliasCommand(const char* cmd_line) : BuiltInCommand("")
+AliasCommand::AliasCommand(const char* cmd_line, int argc) : BuiltInCommand(""), cmd_line(cmd_line), argc(argc)
 {
-    this->cmd_line = cmd_line;
 }
 
-void SmallShell::printAlias()
+void SmallShell::printAlias(std::ostream& out)
 {
-    for (const auto& pair : this->aliasVector) {
-        cout << pair.first
-                  << "='" << pair.second << "'" << endl;
+    for (const auto& alias : aliasTable.list()) {
+        out << alias.name
+                  << "='" << alias.value << "'" << endl;
     }
 }
 
-bool AliasExists(const std::string& newName)
+bool SmallShell::addAlias(const std::string& name, const std::string& value)
 {
-    for (const auto& pair : SmallShell::getInstance().getAliasVector()) {
-        if (pair.first == newName) {
-            return true;
-        }
-    }
-    return false;
+    if (_findBuiltin(name.c_str()) != nullptr || !aliasTable.add(name, value)) return false;
+    parseCache.invalidate();
+    return true;
 }
 
-void AliasRemove(const std::string& Name)
+bool SmallShell::removeAlias(const std::string& name)
 {
-    vector<pair<string,string>>& vector = SmallShell::getInstance().getAliasVector();
-    for (auto it = vector.begin(); it != vector.end();) {
-        if (it->first == Name) {
-            vector.erase(it);
-            return;
-        }
-        ++it;
-    }
+    if (!aliasTable.remove(name)) return false;
+    parseCache.invalidate();
+    return true;
 }
 
-void SmallShell::addAlias(char** argv, const char* cmd_line)
-{
-    char* command_line = strdup(string(cmd_line).c_str());
-    int name_end = string(command_line).find('=');
-    int name_start = string(command_line).find_first_of(' ');
-    string name = string(command_line).substr(name_start + 1, name_end - name_start - 1);
-    size_t start_quote_pos = string(command_line).find_first_of('\'');
-    size_t end_quote_pos = string(command_line).rfind('\'');
-    string command_string = string(command_line).substr(start_quote_pos + 1, end_quote_pos - start_quote_pos - 1);
-    if(!AliasExists(name))
-    {
-        this->aliasVector.push_back({name, command_string});
-    }
-    else
-    {
-        string to_throw ="smash error: alias: "
-        + name + " already exists or is a reserved command";
-        perror(to_throw.c_str());
-        return;
-    }
+/**
+ * Matches alias NAME='VALUE' where NAME is [a-zA-Z0-9_]+ and VALUE holds no
+ * quote, storing the two parts on success.
+ */
+static bool _parseAliasDefinition(const string& line, string* name, string* value) {
+    const char prefix[] = "alias ";
+    size_t prefix_length = sizeof(prefix) - 1;
+    if (line.compare(0, prefix_length, prefix) != 0) return false;
+    size_t i = prefix_length;
+    while (i < line.size() && (isalnum((unsigned char) line[i]) || line[i] == '_')) i++;
+    if (i == prefix_length || i + 2 > line.size() || line[i] != '=' || line[i + 1] != '\'') return false;
+    size_t value_begin = i + 2;
+    size_t value_end = line.find('\'', value_begin);
+    if (value_end != line.size() - 1) return false;
+    name->assign(line, prefix_length, i - prefix_length);
+    value->assign(line, value_begin, value_end - value_begin);
+    return true;
 }
 
 void AliasCommand::execute()
 {
-    const char* raw_cmd_line = this->cmd_line;
+    const char* raw_cmd_line = this->cmd_line.c_str();
     string cmd_s = _trim(raw_cmd_line);
-    char* args[COMMAND_MAX_ARGS];
-    char** argv = args;
-    int argc = _parseCommandLine(raw_cmd_line, argv);
     if (argc == 1)
     {
-        //SmallShell::getInstance().getAliasVector().empty();
-        SmallShell::getInstance().printAlias();
+        SmallShell::getInstance().printAlias(out());
         return;
     }
-    const std::regex pattern("^alias [a-zA-Z0-9_]+='[^']*'$");
-    if(std::regex_match(cmd_s, pattern))
+    string name, value;
+    if(_parseAliasDefinition(cmd_s, &name, &value))
     {
-        SmallShell::getInstance().addAlias(argv, cmd_line);
+        if (!SmallShell::getInstance().addAlias(name, value)) {
+            string to_throw ="smash error: alias: "
+            + name + " already exists or is a reserved command";
+            _perror(err(), to_throw.c_str());
+        }
     }
     else
     {
-        // string flip = cmd_s;
-        // int start = 0, end = cmd_s.size() - 1;
-        // while (start < end) {
-        //     char cpy = flip[start];
-        //     flip[start] = flip[end];
-        //     flip[end] = cpy;
-        //     start++; --end;
-        // }
-        // size_t spot = flip.find_first_of("'");
-
-        perror("smash error: alias: invalid alias format");
+        _perror(err(), "smash error: alias: invalid alias format");
         return;
     }
 }
 
-UnAliasCommand::UnAliasCommand(const char* cmd_line) : BuiltInCommand("")
+UnAliasCommand::UnAliasCommand(char** argv, int argc) : BuiltInCommand(""), argv(argv), argc(argc)
 {
-    this->cmd_line = cmd_line;
 }
 
 void UnAliasCommand::execute()
 {
-    const char* raw_cmd_line = this->cmd_line;
-    char* args[COMMAND_MAX_ARGS];
-    char** argv = args;
-    int argc = _parseCommandLine(raw_cmd_line, argv);
     if (argc == 1)
     {
-        perror("smash error: unalias: not enough arguments");
+        _perror(err(), "smash error: unalias: not enough arguments");
         return;
     }
     else
@@ -800,22 +2429,15 @@ void UnAliasCommand::execute()
         int i = 1;
         while(i < argc)
         {
-            if(!AliasExists(std::string(argv[i])))
+            if(!SmallShell::getInstance().removeAlias(std::string(argv[i])))
             {
                 string to_throw = "smash error: unalias: " + string(argv[i]) + " alias does not exist";
-                cerr<<(to_throw.c_str())<<endl;
+                err()<<(to_throw.c_str())<<endl;
                 return;
             }
-            else
-            {
-                AliasRemove(std::string(argv[i]));
-            }
             i++;
         }
     }
-    // for (int i = 0; i < argc; ++i) {
-    //     free(argv[i]);
-    // }
 }
 
 SysInfoCommand::SysInfoCommand(const char* cmd_line) : BuiltInCommand("")
@@ -823,158 +2445,204 @@ SysInfoCommand::SysInfoCommand(const char* cmd_line) : BuiltInCommand("")
 
 }
 
-string get_kernel_release()
+string get_kernel_release(std::ostream &err)
 {
     char buffer[SYSINFO_BUFFER_SIZE];
     int fd = open("/proc/sys/kernel/osrelease", O_RDONLY);
     if (fd == -1) {
-        perror("smash error: open failed");
+        _perror(err, "smash error: open failed");
         return  "fail";
     }
     ssize_t bytes_read = read(fd, buffer, sizeof(buffer) - 1);
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
-    }
+    buffer[bytes_read > 0 ? bytes_read : 0] = '\0';
     close(fd);
-    string word = strtok(buffer, WHITESPACE.c_str());
-    return word;
+    char *rest;
+    char *word = strtok_r(buffer, WHITESPACE.c_str(), &rest);
+    return word ? word : "";
 }
-string get_system_type(){
+string get_system_type(std::ostream &err){
     char buffer[SYSINFO_BUFFER_SIZE];
     int fd = open("/proc/version", O_RDONLY);
     if (fd == -1) {
-        perror("smash error: open failed");
+        _perror(err, "smash error: open failed");
         return  "fail";
     }
     ssize_t bytes_read = read(fd, buffer, sizeof(buffer) - 1);
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
-    }
+    buffer[bytes_read > 0 ? bytes_read : 0] = '\0';
     close(fd);
-    string word = strtok(buffer, WHITESPACE.c_str());
-    return word;
+    char *rest;
+    char *word = strtok_r(buffer, WHITESPACE.c_str(), &rest);
+    return word ? word : "";
 }
-string get_hostname()
+string get_hostname(std::ostream &err)
 {
     char buffer[SYSINFO_BUFFER_SIZE];
     int fd = open("/proc/sys/kernel/hostname", O_RDONLY);
     if (fd == -1) {
-       perror("smash error: open failed");
+       _perror(err, "smash error: open failed");
         return  "fail";
     }
     ssize_t bytes_read = read(fd, buffer, sizeof(buffer) - 1);
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
-    }
+    buffer[bytes_read > 0 ? bytes_read : 0] = '\0';
     close(fd);
-    string word = strtok(buffer, WHITESPACE.c_str());
-    return word;
+    char *rest;
+    char *word = strtok_r(buffer, WHITESPACE.c_str(), &rest);
+    return word ? word : "";
 }
 
-string get_boot_time()
+string get_boot_time(std::ostream &err)
 {
     struct timespec timeElapsed;
     struct timespec currentTime;
     if(clock_gettime(CLOCK_BOOTTIME, &timeElapsed) != 0)
     {
-        perror("smash error: clock_gettime failed");
+        _perror(err, "smash error: clock_gettime failed");
         return  "fail";
     }
     if(clock_gettime(CLOCK_REALTIME, &currentTime) != 0)
     {
-        perror("smash error: clock_gettime failed");
+        _perror(err, "smash error: clock_gettime failed");
         return  "fail";
     }
     time_t bootTimeInSec = currentTime.tv_sec - timeElapsed.tv_sec;
-    struct tm* bootTime = std::localtime(&bootTimeInSec);
+    struct tm bootTime;
+    localtime_r(&bootTimeInSec, &bootTime);
     char buffer[100];
-    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", bootTime);
+    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &bootTime);
     return string(buffer);
 }
 
 void SysInfoCommand::execute()
 {
-    if (get_system_type() == "fail" || get_hostname() == "fail" ||
-       get_kernel_release() == "fail" || get_boot_time() == "fail")
+    if (get_system_type(err()) == "fail" || get_hostname(err()) == "fail" ||
+       get_kernel_release(err()) == "fail" || get_boot_time(err()) == "fail")
         return;
-    cout << "System: " << get_system_type() << endl;
-    cout << "Hostname: " << get_hostname() << endl;
-    cout << "Kernel: " << get_kernel_release() << endl;
-    cout << "Architecture: x86_64" << endl;
-    cout << "Boot Time: " << get_boot_time() << endl;;
+    out() << "System: " << get_system_type(err()) << endl;
+    out() << "Hostname: " << get_hostname(err()) << endl;
+    out() << "Kernel: " << get_kernel_release(err()) << endl;
+    out() << "Architecture: x86_64" << endl;
+    out() << "Boot Time: " << get_boot_time(err()) << endl;
 }
 
 
-PipeCommand::PipeCommand(const char* cmd_line) : Command(cmd_line) {
-    std::string s1, s2;
-    bool foundPipe = false;
-    for (char ch : std::string(cmd_line)) {
-        if (foundPipe == false) {
-            if (ch == '|') {
-                foundPipe = true;
-            } else {
-                s1 += ch;
-            }
-        } else {
-            s2 += ch;
-        }
+PipeCommand::PipeCommand(const PipelineNode &pipeline) : Command(pipeline.text) {
+    SmallShell& smash = SmallShell::getInstance();
+    for (int i = 0; i < pipeline.stageCount; i++) {
+        const CommandNode& stage = pipeline.stages[i];
+        stages.push_back(smash.CreateCommand(stage, stage.text, false));
+        outputFds.push_back(stage.pipeStderr ? STDERR_FILENO : STDOUT_FILENO);
     }
-   if (s2[0] == '&') {
-       am_i_with_AND = true;
-       s2 = s2.substr(1, s2.size() - 1);
-   }
-    firstCommand = SmallShell::getInstance().CreateCommand(s1.c_str());
-    secondCommand = SmallShell::getInstance().CreateCommand(s2.c_str());
 }
 
+/**
+ * Runs a thread-safe builtin stage on a worker thread of the shell, writing
+ * into the pipe through a PipeSink. The stage owns its pipe ends and closes
+ * them when it is done, so the neighbouring stages see EOF or EPIPE.
+ */
+static void _runStageThread(Command *command, int input, int output, PipeStats *stats, int done) {
+    if (output != -1) {
+        PipeSink sink(output, stats);
+        std::ostream out(&sink);
+        command->setOutput(&out);
+        command->execute();
+        command->setOutput(&std::cout);
+    } else {
+        command->execute();
+    }
+    if (input != -1) close(input);
+    if (output != -1) close(output);
+    uint64_t one = 1;
+    while (write(done, &one, sizeof(one)) == -1 && errno == EINTR) {
+    }
+}
 
+/**
+ * Starts _runStageThread on duplicates of the stage's pipe ends; done is
+ * counted up when the stage finishes. All signals are blocked in the worker,
+ * so they are handled by the main thread and a write to a closed pipe fails
+ * with EPIPE instead of raising SIGPIPE.
+ */
+static std::thread _startStageThread(Command *command, int input, int output, PipeStats *stats, int done) {
+    int stage_input = input == -1 ? -1 : fcntl(input, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+    int stage_output = output == -1 ? -1 : fcntl(output, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    std::thread worker(_runStageThread, command, stage_input, stage_output, stats, done);
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    return worker;
+}
 
+/**
+ * Starts every stage, each reading the pipe written by the stage before it,
+ * then waits for them all. Thread-safe builtins writing to stdout run on
+ * worker threads; every other stage is a process in one process group.
+ */
 void PipeCommand::execute() {
-    int my_pipe[2];
-    while (pipe(my_pipe) == -1) {}
-    pid_t pid1 = fork();
-    if (pid1 == -1) {
-        perror("smash error: fork failed");
-        return;
-    }
-    if (pid1 == 0) { //the child proccess
-        close(my_pipe[0]); //close read end
-        setpgrp();
-        int fd_to_write = (this->am_i_with_AND) ? STDERR_FILENO : STDOUT_FILENO;
-        int dup_worked = dup2(my_pipe[1], fd_to_write); //redirect stdout to write end of pipe
-        if (dup_worked == -1) {
-            perror("smash error: dup2 failed");
-            return;
+    SmallShell& smash = SmallShell::getInstance();
+    PipeStats* stats = smash.getPipeStats();
+    std::vector<pid_t> pids;
+    std::vector<std::thread> threads;
+    pids.reserve(stages.size());
+    pid_t pgid = 0;
+    int input = -1;
+    int done = -1; // counts the stages running as threads that finished
+    for (size_t i = 0; i < stages.size(); i++) {
+        int pipe_fds[2] = {-1, -1};
+        if (i + 1 < stages.size()) {
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                perror("smash error: pipe failed");
+                break;
+            }
+            if (smash.getPipeBufferSize() && fcntl(pipe_fds[1], F_SETPIPE_SZ, smash.getPipeBufferSize()) == -1) {
+                perror("smash error: fcntl failed");
+            }
+            stats->pipes++;
+        }
+        if (stages[i] && stages[i]->threadSafe && outputFds[i] == STDOUT_FILENO &&
+            (done != -1 || (done = _shellFd(eventfd(0, EFD_CLOEXEC))) != -1)) {
+            threads.push_back(_startStageThread(stages[i], input, pipe_fds[1], stats, done));
+            smash.foreground.stages.push_back(stages[i]);
+        } else if (stages[i]) {
+            StageIo io;
+            io.input = input;
+            io.output = pipe_fds[1];
+            io.outputFd = outputFds[i];
+            io.close = pipe_fds[0];
+            io.pgid = pgid;
+            pid_t pid = stages[i]->start(io);
+            if (pid != -1) {
+                if (!pgid) pgid = pid;
+                pids.push_back(pid);
+            }
+        }
+        if (input != -1) close(input);
+        if (pipe_fds[1] != -1) close(pipe_fds[1]);
+        input = pipe_fds[0];
+    }
+    if (input != -1) close(input);
+    // not stoppable: the stages running as threads cannot be stopped
+    if (pgid) smash.foreground.pgid = pgid;
+    for (pid_t pid : pids) {
+        struct rusage usage;
+        if (_waitForeground(pid, nullptr, &usage) != -1) {
+            __sync_fetch_and_add(&stats->stageSwitches, usage.ru_nvcsw);
         }
-        close(my_pipe[1]); //close write end of pipe
-        firstCommand->setPID(getppid());
-        SmallShell::getInstance().getJobList()->addJob(firstCommand, 0);
-        firstCommand->execute();
-        exit(0);
-    }
-    pid_t pid2 = fork();
-    if (pid2 == -1) {
-        perror("smash error: fork failed");
-        return;
     }
-    if (pid2 == 0) { //the second child proccess
-        close(my_pipe[1]); //close write end of pipe
-        setpgrp();
-        int dup_worked = dup2(my_pipe[0], 0); //redirect stdin to read end of pipe
-        if (dup_worked == -1) {
-            perror("smash error: dup2 failed");
-            return;
+    // a ctrl-C from here on only has the threads left to cancel
+    smash.foreground.pgid = -10;
+    uint64_t finished = 0;
+    while (finished < threads.size()) {
+        uint64_t count;
+        if (smash.waitForeground(&done, 1) == 0 && read(done, &count, sizeof(count)) == sizeof(count)) {
+            finished += count;
         }
-        close(my_pipe[0]); //close read end of pipe
-        secondCommand->setPID(getppid());
-        SmallShell::getInstance().getJobList()->addJob(secondCommand, 0);
-        secondCommand->execute();
-        exit(0);
     }
-    close(my_pipe[0]);
-    close(my_pipe[1]);
-    waitpid(pid1, nullptr, 0);
-    waitpid(pid2, nullptr, 0);
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    if (done != -1) close(done);
+    smash.foreground = SmallShell::Foreground();
 }
 
 WhoAmICommand::WhoAmICommand(const char* cmd_line) : Command(cmd_line){}
@@ -987,7 +2655,7 @@ void WhoAmICommand::execute() {
     std::string lineBuff;
     int fd = open("/etc/passwd", O_RDONLY);
     if (fd == -1) {
-        perror("smash error: open failed");
+        _perror(err(), "smash error: open failed");
         return;
     }
     char ch;
@@ -1019,10 +2687,10 @@ void WhoAmICommand::execute() {
         current_segment.clear();
         segments.clear();
     }
-    std::cout << username <<  std::endl;
-    std::cout << my_uid << std::endl;
-    std::cout << my_gid <<  std::endl;
-    std::cout << home_directory <<  std::endl;
+    out() << username <<  std::endl;
+    out() << my_uid << std::endl;
+    out() << my_gid <<  std::endl;
+    out() << home_directory <<  std::endl;
     close (fd);
 }
 
@@ -1032,12 +2700,20 @@ QuitCommand::QuitCommand(const char* cmd_line, JobsList* jobs, bool isKill) : Bu
     this->jobs = jobs;
 }
 
+/**
+ * In a forked pipeline stage quit ends only the stage: returning lets
+ * Command::start hand over the stage's output and leave with _exit(), where
+ * exit() would run the shell's destructors and join worker threads that
+ * exist only in the shell.
+ */
 void QuitCommand::execute()
 {
-    if (!isKill) exit(0);
-    JobsList* jobL = SmallShell::getInstance().getJobList();
-    jobL->printJobsList_forQUIT();
-    exit (0);
+    SmallShell& smash = SmallShell::getInstance();
+    if (isKill) {
+        smash.getJobList()->printJobsList_forQUIT(out());
+        out().flush();
+    }
+    if (smash.isShellProcess()) exit(0);
 }
 
 ForegroundCommand::ForegroundCommand(const char *cmd_line, int id):BuiltInCommand(cmd_line), jobID_to_foreground(id) {}
@@ -1047,33 +2723,114 @@ ForegroundCommand::ForegroundCommand(const char *cmd_line):BuiltInCommand(cmd_li
 
 void ForegroundCommand::execute() {
     SmallShell::getInstance().getJobList()->removeFinishedJobs();
-    if (SmallShell::getInstance().getJobList()->jobsVector.size() == 0) {
-        cerr<<("smash error: fg: jobs list is empty")<<endl;
+    if (SmallShell::getInstance().getJobList()->size() == 0) {
+        err()<<("smash error: fg: jobs list is empty")<<endl;
         return;
     }
     JobsList::JobEntry* to_bring = SmallShell::getInstance().getJobList()->getJobById(jobID_to_foreground);
     if (to_bring == nullptr) {
         string to_throw = "smash error: fg: job-id "+to_string(jobID_to_foreground)+" does not exist";
-        cerr<<(to_throw.c_str())<<endl;
+        err()<<(to_throw.c_str())<<endl;
         return;
     }
     pid_t PID = to_bring->getPid();
-    cout << to_bring->getCommandLine() << " " << (int)(PID) <<endl;
-    waitpid(PID, nullptr, 0);
-    SmallShell::getInstance().getJobList()->removeJobById(jobID_to_foreground);
+    SmallShell& smash = SmallShell::getInstance();
+    if (to_bring->getBuiltin()) {
+        out() << to_bring->getCommandLine() << " builtin" << endl;
+        smash.foreground.builtin = to_bring->getBuiltin()->command;
+    } else {
+        out() << to_bring->getCommandLine() << " " << (int)(PID) <<endl;
+        smash.foreground.pgid = PID;
+    }
+    smash.foreground.stoppable = !to_bring->getBuiltin();
+    bool finished = to_bring->wait();
+    smash.foreground = SmallShell::Foreground();
+    if (finished) smash.getJobList()->removeJobById(jobID_to_foreground);
+}
+
+WaitCommand::WaitCommand(const char *cmd_line, const std::vector<int> &ids, bool any, int timeout) :
+    BuiltInCommand(cmd_line), jobIds(ids), any(any), timeout(timeout) {}
+
+/**
+ * Sleeps on the same descriptors that wake the job reaper, so waiting for
+ * any number of jobs costs nothing until one of them finishes.
+ */
+void WaitCommand::execute() {
+    SmallShell& smash = SmallShell::getInstance();
+    JobsList* jobs = smash.getJobList();
+    jobs->removeFinishedJobs();
+    std::vector<int> waiting = jobIds;
+    for (int id : waiting) {
+        if (!jobs->getJobById(id)) {
+            err() << "smash error: wait: job-id " << id << " does not exist" << endl;
+            return;
+        }
+    }
+    for (int id = 1; jobIds.empty() && id <= jobs->getMaxID(); id++) {
+        if (jobs->getJobById(id)) waiting.push_back(id);
+    }
+    int fds[2] = {jobs->getChildFd(), jobs->getWakeFd()};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (true) {
+        size_t finished = 0;
+        for (int id : waiting) {
+            if (!jobs->getJobById(id)) finished++;
+        }
+        if (finished == waiting.size() || (any && finished)) return;
+        int left = -1;
+        if (timeout >= 0) {
+            long elapsed = _millisecondsSince(start);
+            left = elapsed >= timeout * 1000L ? 0 : (int) (timeout * 1000L - elapsed);
+        }
+        if (smash.waitForeground(fds, 2, left) == -1) {
+            if (!smash.foreground.interrupted) err() << "smash error: wait: timed out" << endl;
+            return;
+        }
+        jobs->removeFinishedJobs();
+    }
+}
+
+BackgroundCommand::BackgroundCommand(const char *cmd_line, int id) : BuiltInCommand(cmd_line), jobId(id) {}
+
+void BackgroundCommand::execute() {
+    JobsList* jobs = SmallShell::getInstance().getJobList();
+    jobs->removeFinishedJobs();
+    JobsList::JobEntry* job = jobId ? jobs->getJobById(jobId) : jobs->getLastStoppedJob(nullptr);
+    if (!job && jobId) {
+        err() << "smash error: bg: job-id " << jobId << " does not exist" << endl;
+        return;
+    }
+    if (!job) {
+        err() << "smash error: bg: there is no stopped jobs to resume" << endl;
+        return;
+    }
+    if (!job->isStopped()) {
+        err() << "smash error: bg: job-id " << jobId << " is already running in the background" << endl;
+        return;
+    }
+    out() << job->getCommandLine() << " " << job->getPid() << endl;
+    if (!job->sendSignal(SIGCONT)) {
+        _perror(err(), "smash error: kill failed");
+        return;
+    }
+    job->setStopped(false);
 }
 
 DiskUsageCommand::DiskUsageCommand(const char *cmd_line, string path) : Command(cmd_line)
 {
     this->cmd_line = cmd_line;
     this->path = path;
+    // run in the background, du must not follow a later cd of the shell
+    char cwd[PATH_MAX];
+    if (path[0] != '/' && getcwd(cwd, sizeof(cwd))) this->path = string(cwd) + "/" + path;
 }
 
-size_t DUAux(string path){
+size_t DUAux(string path, const Command &command){
     int block_size = 512;
     struct stat sb;
     if (lstat(path.c_str(), &sb) == -1) {
-        perror("smash error: lstat failed");
+        _perror(command.err(), "smash error: lstat failed");
         return 0;
     }
     size_t total_size_of_me = sb.st_blocks * block_size;
@@ -1086,9 +2843,9 @@ size_t DUAux(string path){
         char buffer[4096];
         while (true) {
             long num_read = syscall(SYS_getdents, fd, buffer, sizeof(buffer));
-            if (num_read == -1 || num_read == 0) break;
+            if (num_read == -1 || num_read == 0 || command.isCancelled()) break;
 
-            for (long bpos = 0; bpos < num_read;) {
+            for (long bpos = 0; bpos < num_read && !command.isCancelled();) {
                 struct linux_dirent* current = (struct linux_dirent*)(buffer + bpos);
                 string currentName = current->current_name;
                 if (currentName != "." && currentName != "..") {
@@ -1097,7 +2854,7 @@ size_t DUAux(string path){
                         next_path = path + currentName;
                     else
                         next_path = path + "/" + currentName;
-                    total_size_of_me += DUAux(next_path);
+                    total_size_of_me += DUAux(next_path, command);
                 }
                 bpos += current->current_reclen;
             }
@@ -1110,67 +2867,187 @@ size_t DUAux(string path){
 
 void DiskUsageCommand::execute()
 {
-    cout << "Total disk usage: " << (DUAux(path) + 1023)/1024 << " KB" << endl;
+    size_t total = DUAux(path, *this);
+    if (isCancelled()) return;
+    out() << "Total disk usage: " << (total + 1023)/1024 << " KB" << endl;
 }
 
-RedirectionCommand::RedirectionCommand(std::string command,std::string path, bool is_append, bool is_overwrite) : Command("")
+RedirectionCommand::RedirectionCommand(const BuiltinEntry *builtin, const CommandNode &node, const char *cmd_line) :
+    Command(cmd_line), builtin(builtin), node(node)
 {
-    this->command = _trim(command);
-    this->path = _trim(path);
-    this->is_append = is_append;
-    this->is_overwrite = is_overwrite;
 }
 
+/**
+ * Applies the redirections to what descriptors 0-9 stand for, then runs the
+ * builtin with its output and errors going through FdSinks on the files.
+ * The shell's own descriptors are never touched.
+ */
 void RedirectionCommand::execute()
 {
-    int flags = O_WRONLY | O_CREAT;
-    if (is_append) flags |= O_APPEND;
-    if (is_overwrite) flags |= O_TRUNC;
+    struct Target {
+        std::ostream *stream; // a stream of this command, or
+        int fd;               // a descriptor, -1 if closed
+    };
+    const int TARGETS = 10;
+    Target targets[TARGETS];
+    for (int fd = 0; fd < TARGETS; fd++) {
+        targets[fd].stream = nullptr;
+        targets[fd].fd = fd;
+    }
+    targets[STDOUT_FILENO].stream = output;
+    targets[STDERR_FILENO].stream = errors;
+
+    std::vector<int> opened;
+    bool ready = true;
+    for (int i = 0; i < node.redirectionCount && ready; i++) {
+        const Redirection& redirection = node.redirections[i];
+        Target target = {nullptr, -1};
+        if (redirection.type == REDIRECT_DUPLICATE) {
+            int source;
+            ready = _duplicateSource(redirection.target, &source);
+            if (ready && source >= 0) {
+                target = source < TARGETS ? targets[source] : Target{nullptr, source};
+                ready = target.stream || target.fd == -1 || fcntl(target.fd, F_GETFD) != -1;
+            }
+            if (!ready) {
+                errno = EBADF;
+                _perror(err(), "smash error: dup2 failed");
+            }
+        } else {
+            target.fd = _openRedirection(redirection, err());
+            ready = target.fd != -1;
+            if (ready) opened.push_back(target.fd);
+        }
+        if (ready && redirection.fd < TARGETS) targets[redirection.fd] = target;
+    }
+
+    if (ready && builtin) {
+        const Target& out_target = targets[STDOUT_FILENO];
+        const Target& err_target = targets[STDERR_FILENO];
+        FdSink out_sink(out_target.fd), err_sink(err_target.fd);
+        std::ostream out_stream(&out_sink), err_stream(&err_sink);
+        std::ostream* command_out = out_target.stream ? out_target.stream : &out_stream;
+        std::ostream* command_err = err_target.stream ? err_target.stream :
+                                    !out_target.stream && out_target.fd == err_target.fd ? &out_stream : &err_stream;
+        BuiltinArgs args = {cmdLine, node.argv, node.argc, *command_err};
+        Command* command = builtin->create(args);
+        if (command) {
+            SmallShell::Foreground& foreground = SmallShell::getInstance().foreground;
+            if (foreground.builtin == this) foreground.builtin = command; // ctrl-C must reach the builtin
+            command->setOutput(command_out);
+            command->setErrors(command_err);
+            command->execute();
+            if (foreground.builtin == command) foreground.builtin = this;
+            delete command;
+        }
+        out_stream.flush();
+        err_stream.flush();
+    }
+    for (int fd : opened) {
+        close(fd);
+    }
+}
 
-    int stdout_temp = dup(STDOUT_FILENO);
-    if (stdout_temp == -1) {
-        perror("smash error: dup Failed");
-        return;
+
+
+
+SetCommand::SetCommand(const char *cmd_line, SetOption option, long value) : BuiltInCommand(cmd_line),
+    option(option), value(value) {}
+
+/**
+ * Returns the largest pipe an unprivileged process may ask for.
+ */
+static long _pipeMaxSize() {
+    long size = 1024 * 1024;
+    FILE* file = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (file) {
+        if (fscanf(file, "%ld", &size) != 1) size = 1024 * 1024;
+        fclose(file);
+    }
+    return size;
+}
+
+/**
+ * Sizes a scratch pipe to size bytes and returns the size the kernel gave
+ * it, rounded up to a power of two pages, or -1 if it refused.
+ */
+static long _applyPipeSize(long size) {
+    int probe[2];
+    if (pipe2(probe, O_CLOEXEC) == -1) return -1;
+    long applied = fcntl(probe[1], F_SETPIPE_SZ, (int) size);
+    int error = errno;
+    close(probe[0]);
+    close(probe[1]);
+    errno = error;
+    return applied;
+}
+
+void SetCommand::execute() {
+    SmallShell& smash = SmallShell::getInstance();
+    switch (option) {
+        case SET_PRINT:
+            out() << "spawn=" << SPAWN_BACKEND_NAMES[smash.getSpawnBackend()] << endl;
+            if (smash.getPipeBufferSize()) out() << "pipebuf=" << smash.getPipeBufferSize() << endl;
+            else out() << "pipebuf=default" << endl;
+            break;
+        case SET_SPAWN:
+            smash.setSpawnBackend((SpawnBackend) value);
+            break;
+        case SET_PIPEBUF: {
+            if (value == 0) {
+                smash.setPipeBufferSize(0);
+                break;
+            }
+            long applied = _applyPipeSize(std::min(value, _pipeMaxSize()));
+            if (applied == -1) _perror(err(), "smash error: fcntl failed");
+            else smash.setPipeBufferSize((int) applied);
+            break;
+        }
     }
+}
 
-    int fd = open(path.c_str(), flags, 0644);
-    if (fd == -1) {
-        perror("smash error: open failed:");
+PipeStatCommand::PipeStatCommand(const char *cmd_line, bool clear) : BuiltInCommand(cmd_line), clear(clear) {}
+
+void PipeStatCommand::execute() {
+    PipeStats* stats = SmallShell::getInstance().getPipeStats();
+    if (clear) {
+        *stats = PipeStats();
         return;
     }
+    out() << "pipestat: " << stats->pipes << " pipes, " << stats->writerBlocks << " writer blocks, "
+         << stats->stageSwitches << " stage context switches" << endl;
+}
 
-    if (dup2(fd, STDOUT_FILENO) == -1)
-    {
-        close(fd);
-        perror("smash error: dup2 failed");
+HashCommand::HashCommand(const char *cmd_line, bool reset) : BuiltInCommand(cmd_line), reset(reset) {}
+
+void HashCommand::execute() {
+    PathCache& cache = SmallShell::getInstance().getPathCache();
+    if (reset) {
+        cache.clear();
         return;
     }
-    close(fd);
-    Command* newCommand = SmallShell::getInstance().CreateCommand(command.c_str());
-    if (newCommand)
-    {
-        newCommand->execute();
-        delete newCommand;
+    cache.print(out());
+}
+
+CmdCacheCommand::CmdCacheCommand(const char *cmd_line, bool clear, int capacity) : BuiltInCommand(cmd_line),
+    clear(clear), capacity(capacity) {}
+
+void CmdCacheCommand::execute() {
+    ParseCache& cache = SmallShell::getInstance().getParseCache();
+    if (clear) {
+        cache.clear();
+        return;
     }
-    if (dup2(stdout_temp, STDOUT_FILENO) == -1) {
-        perror("smash error: dup2 failed");
+    if (capacity > 0) {
+        cache.setCapacity(capacity);
         return;
     }
-    close(stdout_temp);
+    out() << "cmdcache: " << cache.getHits() << " hits, " << cache.getMisses() << " misses, "
+         << cache.size() << "/" << cache.getCapacity() << " entries" << endl;
 }
 
-
-
-
-UnSetEnvCommand::UnSetEnvCommand(const char* command_line) : BuiltInCommand("")
+UnSetEnvCommand::UnSetEnvCommand(char** argv, int argc) : BuiltInCommand(""), args(argv), agrc(argc)
 {
-    const char* raw_cmd_line = command_line;
-    char* args[COMMAND_MAX_ARGS];
-    char** argv = args;
-    int argc = 0;
-    argc = _parseCommandLine(raw_cmd_line, argv);
-    this->args = argv;
-    this->agrc = argc;
 }
 
 void UnSetEnvCommand::execute()
@@ -1200,7 +3077,7 @@ void UnSetEnvCommand::execute()
         if (!var_found)
         {
             string to_throw = "smash error: unsetenv: " + varName + " does not exist";
-            cerr<<(to_throw.c_str())<<endl;
+            err()<<(to_throw.c_str())<<endl;
             return;
         }
         var_found = false;
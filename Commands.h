@@ -5,27 +5,474 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <list>
+#include <unordered_map>
+#include <ostream>
+#include <streambuf>
+#include <ctime>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <sys/resource.h>
+#include <csignal>
+#include <unistd.h>
 
 #define COMMAND_MAX_LENGTH (200)
 #define COMMAND_MAX_ARGS (20)
+#define PARSE_CACHE_SIZE (256)
+#define HEREDOC_PIPE_LIMIT (64 * 1024)
+#define JOB_HISTORY_SIZE (16)
+#define SIGNAL_POLL_INTERVAL (64)
+#define SHELL_FD_BASE (10) // the shell's own descriptors are kept at or above this
+
+enum RedirectionType {
+    REDIRECT_OVERWRITE, // N>
+    REDIRECT_APPEND,    // N>>
+    REDIRECT_INPUT,     // N<
+    REDIRECT_DUPLICATE, // N>&M or N<&M, target is M or "-" to close N
+    REDIRECT_HEREDOC,   // N<<WORD, target is the delimiter of the body that follows the line
+    REDIRECT_HERESTRING // N<<<WORD
+};
+
+struct Redirection {
+    RedirectionType type;
+    int fd; // N, defaulting to 0 for input and 1 otherwise
+    const char *target;
+};
+
+/**
+ * A single command of a pipeline: its words (NULL-terminated) and the
+ * redirections that apply to it, all pointing into the owning ParsedLine.
+ */
+struct CommandNode {
+    char **argv;
+    int argc;
+    const Redirection *redirections;
+    int redirectionCount;
+    bool pipeStderr; // followed by |& rather than |
+    const char *text;
+};
+
+struct PipelineNode {
+    const CommandNode *stages;
+    int stageCount;
+    bool background;
+    const char *text; // as typed, including the trailing &
+};
+
+class AliasTable;
+
+/**
+ * The AST of one input line: a list of pipelines separated by ';' or '&'.
+ * The line is read once; words, redirection targets and the text of every
+ * node are NUL-terminated copies in a single buffer that is reused by the
+ * next parse. Commands built from the nodes borrow these pointers, so a
+ * ParsedLine must outlive them.
+ */
+class ParsedLine {
+    enum TokenType {
+        TOKEN_WORD,
+        TOKEN_PIPE,       // |
+        TOKEN_PIPE_ERR,   // |&
+        TOKEN_BACKGROUND, // &
+        TOKEN_SEPARATOR,  // ;
+        TOKEN_OVERWRITE,  // >
+        TOKEN_APPEND,     // >>
+        TOKEN_INPUT,      // <
+        TOKEN_DUPLICATE,  // >& or <&
+        TOKEN_HEREDOC,    // <<
+        TOKEN_HERESTRING  // <<<
+    };
+
+    struct Token {
+        TokenType type;
+        int fd;    // the descriptor a redirection applies to
+        int word;  // offset of the word in buffer
+        int begin; // span in the original line
+        int end;
+    };
+
+    struct PendingCommand {
+        int firstWord;
+        int firstRedirection;
+        int text;
+    };
+
+    struct PendingPipeline {
+        int firstStage;
+        int text;
+    };
+
+public:
+    /** An alias value split into tokens once, when the alias is defined. */
+    struct Expansion {
+        std::vector<char> buffer;
+        std::vector<Token> tokens;
+    };
+
+    static void compile(const std::string &value, Expansion &expansion);
+
+    ParsedLine() = default;
+
+    ParsedLine(ParsedLine const &) = delete;
+
+    void operator=(ParsedLine const &) = delete;
+
+    bool parse(const char *cmd_line, const AliasTable &aliases);
+
+    int size() const { return (int) pipelines.size(); }
+
+    const PipelineNode &pipeline(int i) const { return pipelines[i]; }
+
+    bool isValid() const { return error.empty(); }
+
+    const std::string &getError() const { return error; }
+
+private:
+    std::vector<char> buffer;
+    std::vector<Token> tokens;
+    std::vector<int> wordOffsets; // -1 terminates the words of a command
+    std::vector<int> targetOffsets;
+    std::vector<PendingCommand> pendingCommands;
+    std::vector<PendingPipeline> pendingPipelines;
+    std::vector<char *> words;
+    std::vector<Redirection> redirections;
+    std::vector<CommandNode> commands;
+    std::vector<PipelineNode> pipelines;
+    std::string error;
+
+    void lex(const char *line, int begin, int end, const AliasTable *aliases);
+
+    void expand(const Expansion &expansion, int begin, int end);
+
+    int storeText(const char *line, int begin, int end);
+
+    void finish();
+};
+
+/**
+ * Aliases in definition order, indexed by name for constant-time lookup
+ * during parsing. The value of each alias is tokenized once, when it is added.
+ */
+class AliasTable {
+public:
+    struct Alias {
+        std::string name;
+        std::string value;
+        ParsedLine::Expansion expansion;
+    };
+
+    AliasTable() = default;
+
+    AliasTable(AliasTable const &) = delete;
+
+    void operator=(AliasTable const &) = delete;
+
+    const Alias *find(const char *name) const;
+
+    bool add(const std::string &name, const std::string &value);
+
+    bool remove(const std::string &name);
+
+    const std::list<Alias> &list() const { return aliases; }
+
+private:
+    std::list<Alias> aliases;
+    std::unordered_map<std::string, std::list<Alias>::iterator> index;
+    mutable std::string key;
+};
+
+/**
+ * Bounded LRU cache from an exact input line to its parsed, alias-expanded
+ * form, so a repeated line skips lexing and parsing entirely. Entries remember
+ * the alias generation they were parsed under; invalidate() only bumps the
+ * generation and a stale entry is reparsed in place on its next use, so a
+ * line that is still executing is never freed under it.
+ */
+class ParseCache {
+    struct Entry {
+        std::string line;
+        unsigned int generation = 0;
+        ParsedLine parsed;
+    };
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::string key;
+    size_t capacity;
+    unsigned int generation = 0;
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+public:
+    explicit ParseCache(size_t capacity) : capacity(capacity) {}
+
+    ParseCache(ParseCache const &) = delete;
+
+    void operator=(ParseCache const &) = delete;
+
+    const ParsedLine &lookup(const char *cmd_line, const AliasTable &aliases);
+
+    void invalidate() { generation++; }
+
+    void clear();
+
+    void setCapacity(size_t new_capacity);
+
+    size_t getCapacity() const { return capacity; }
+
+    size_t size() const { return entries.size(); }
+
+    unsigned long getHits() const { return hits; }
+
+    unsigned long getMisses() const { return misses; }
+};
+
+/**
+ * Remembers where each command name was found in PATH, and which names were
+ * not found, so an exec does not probe every PATH directory. The cache is
+ * dropped when PATH changes or when one of its directories is modified;
+ * directory times are checked at most once a second.
+ */
+class PathCache {
+public:
+    PathCache() = default;
+
+    PathCache(PathCache const &) = delete;
+
+    void operator=(PathCache const &) = delete;
+
+    /** Returns the file to exec for name, or nullptr if it is not in PATH. */
+    const char *find(const char *name);
+
+    void forget(const char *name);
+
+    void clear() { entries.clear(); }
+
+    void print(std::ostream &out) const;
+
+private:
+    struct Entry {
+        std::string path; // empty if the name was not found
+        unsigned long hits = 0;
+    };
+
+    struct Directory {
+        std::string path;
+        struct timespec mtime;
+    };
+
+    std::unordered_map<std::string, Entry> entries;
+    std::string pathValue;
+    bool pathSet = false;
+    std::vector<Directory> directories;
+    time_t lastCheck = 0;
+    std::string key;
+    std::string candidate;
+
+    void validate();
+};
+
+/** How external commands are started; see SmallShell::setSpawnBackend. */
+enum SpawnBackend {SPAWN_POSIX, SPAWN_VFORK, SPAWN_FORK};
+
+/** Makes fd a copy of source in the child, or closes fd if source is -1. */
+struct FdAction {
+    int fd;
+    int source;
+};
+
+/**
+ * The standard streams of a process being started. In the child, input is
+ * duplicated onto stdin and output onto outputFd, and close (the other end
+ * of a pipe) is closed. -1 leaves a stream inherited. The process joins
+ * group pgid, or leads a new group if pgid is 0.
+ */
+struct StageIo {
+    int input = -1;
+    int output = -1;
+    int outputFd = 1;
+    int close = -1;
+    pid_t pgid = 0;
+    const FdAction *actions = nullptr; // applied in order, after the streams
+    int actionCount = 0;
+};
+
+/**
+ * Pipeline counters. They live in memory shared with forked stages, so a
+ * builtin stage running in a child can count too.
+ */
+struct PipeStats {
+    unsigned long pipes;
+    unsigned long writerBlocks;  // builtin writes that found the pipe full
+    unsigned long stageSwitches; // voluntary context switches of reaped stages
+};
+
+/**
+ * The destination of a command's output. Commands write to an std::ostream
+ * over a sink, so the shell can send builtin output to a file, a pipe or
+ * memory without moving its own file descriptors around.
+ */
+class OutputSink : public std::streambuf {
+public:
+    /** False once a write has failed; later output is discarded. */
+    bool good() const { return !failed; }
+
+protected:
+    bool failed = false;
+};
+
+/**
+ * A sink that moves builtin output into a pipe with vmsplice, so the
+ * kernel takes the pages by reference instead of copying them. Output is
+ * collected in a chunk of fresh anonymous pages sized from the pipe
+ * capacity. A spliced chunk is gifted and unmapped, never written again:
+ * a reader that splices on still refers to its pages long after reading
+ * them. Output moves when a chunk fills or the sink is destroyed, not on
+ * every flush, since each splice takes a pipe slot. Writes that find the
+ * pipe full are counted.
+ */
+class PipeSink : public OutputSink {
+public:
+    explicit PipeSink(int fd, PipeStats *stats = nullptr);
+
+    PipeSink(PipeSink const &) = delete;
+
+    void operator=(PipeSink const &) = delete;
+
+    ~PipeSink();
+
+protected:
+    int_type overflow(int_type ch) override;
+
+    int sync() override;
+
+private:
+    static const size_t MIN_CHUNK_SIZE = 64 * 1024;
+    int fd;
+    PipeStats *stats;
+    size_t chunkSize = MIN_CHUNK_SIZE;
+    bool splicing;
+    char *chunk = nullptr;
+
+    bool flush();
+
+    bool nextChunk();
+};
+
+/** A sink that buffers output and write()s it to a file descriptor it does not own. */
+class FdSink : public OutputSink {
+public:
+    explicit FdSink(int fd);
+
+    FdSink(FdSink const &) = delete;
+
+    void operator=(FdSink const &) = delete;
+
+    ~FdSink();
+
+protected:
+    int_type overflow(int_type ch) override;
+
+    int sync() override;
+
+private:
+    int fd;
+    char buffer[4096];
+
+    bool flush();
+};
+
+/** A sink that keeps output in memory; clear() keeps its storage for the next use. */
+class BufferSink : public OutputSink {
+public:
+    BufferSink() = default;
+
+    BufferSink(BufferSink const &) = delete;
+
+    void operator=(BufferSink const &) = delete;
+
+    const std::string &str() const { return buffer; }
+
+    void clear() { buffer.clear(); }
+
+protected:
+    int_type overflow(int_type ch) override;
+
+    std::streamsize xsputn(const char *data, std::streamsize count) override;
+
+private:
+    std::string buffer;
+};
+
+/**
+ * Commands are created and destroyed once per line, so their storage is
+ * recycled through per-size free lists instead of going to the heap.
+ */
+class CommandPool {
+public:
+    static void *allocate(size_t size);
+
+    static void release(void *ptr, size_t size);
+
+private:
+    static const size_t GRANULE = 16;
+    static const size_t CLASSES = 16;
+    static void *freeLists[CLASSES];
+};
 
 class Command {
 public:
     pid_t currentPID;
-    std::string cmdLine;
-    std::string cmd_to_print = "-1";//filler for print usage in jobs
-    explicit Command(const char *cmd_line , pid_t pid = -1) :
-     currentPID(pid) , cmdLine(cmd_line) {}
+    const char *cmdLine; // as typed, borrowed from the ParsedLine
+    std::ostream *output;
+    std::ostream *errors;
+    bool threadSafe = false; // only writes to out(), may run on a worker thread
+    bool detachable = false; // with a trailing &, runs as a job on a worker thread
+    std::atomic<int> cancelled{0}; // the signal the command was cancelled by, or 0
+    explicit Command(const char *cmd_line , pid_t pid = -1);
+
+    /** The stream the command writes its output to, std::cout unless redirected. */
+    std::ostream &out() { return *output; }
+
+    void setOutput(std::ostream *stream) { output = stream; }
+
+    /** The stream error messages go to, std::cerr unless redirected. */
+    std::ostream &err() const { return *errors; }
+
+    void setErrors(std::ostream *stream) { errors = stream; }
 
-    std::string getCmdLine() const { return cmdLine; }
+    /** Asks a command running on a worker thread to stop as soon as it can, because of signum. */
+    void cancel(int signum = SIGINT) { cancelled = signum; }
 
-    std::string getCmdLine_Print() const { return cmd_to_print; }
+    /**
+     * Whether the command was cancelled. On the shell's main thread, signals
+     * that arrived meanwhile are handled first, so ctrl-C reaches a builtin
+     * running in the foreground.
+     */
+    bool isCancelled() const;
+
+    /** The signal the command was cancelled by, or 0. */
+    int getCancelSignal() const { return cancelled; }
+
+    static void *operator new(size_t size) { return CommandPool::allocate(size); }
+
+    static void operator delete(void *ptr, size_t size) { CommandPool::release(ptr, size); }
+
+    const char *getCmdLine() const { return cmdLine; }
 
     pid_t getPid() const { return currentPID; }
 
     virtual ~Command();
 
     virtual void execute() = 0;
+
+    /**
+     * Runs the command in a child process with the given streams and process
+     * group, and returns the child's pid, or -1 if it could not be started.
+     */
+    virtual pid_t start(const StageIo &io);
     void setPID(pid_t m_pid){currentPID = m_pid;}
 
     //virtual void prepare();
@@ -40,26 +487,65 @@ public:
     virtual ~BuiltInCommand() {}
 };
 
+/**
+ * Pathname expansion for the words of an external command. Words are
+ * unquoted; unquoted *, ? and [...] are matched against directory entries
+ * one path component at a time, and a pattern that matches nothing is kept
+ * as written. The expanded argv points into buffers reused by the next call.
+ */
+class GlobExpansion {
+public:
+    /** Returns true if any word holds a character that expansion handles. */
+    static bool needed(char **argv);
+
+    char **expand(char **argv);
+
+private:
+    std::vector<char> buffer;
+    std::vector<size_t> words;
+    std::vector<char *> argv;
+    std::string pattern;
+    std::string path;
+
+    void expandWord(const char *word);
+
+    void match(size_t position);
+
+    void addMatch();
+};
+
 class ExternalCommand : public Command {
+    char **argv;
     bool am_i_complex = false;
+    GlobExpansion glob;
     bool am_i_in_background = false;
+    const Redirection *redirections;
+    int redirectionCount;
+    std::vector<FdAction> actions;
+    std::vector<int> opened;
 public:
-    ExternalCommand(const char *cmd_line);
+    ExternalCommand(const CommandNode &node, const char *cmd_line, bool background);
 
     virtual ~ExternalCommand() {
     }
 
     void execute() override;
+
+    pid_t start(const StageIo &io) override;
 };
 
 
+struct BuiltinEntry;
+
+/**
+ * A builtin with redirections, or redirections alone. The builtin is created
+ * when the command runs, once its output and error streams are in place.
+ */
 class RedirectionCommand : public Command {
-    std::string command;
-    std::string path;
-    bool is_append;
-    bool is_overwrite;
+    const BuiltinEntry *builtin;
+    const CommandNode &node;
 public:
-    explicit RedirectionCommand(std::string command, std::string path, bool is_append, bool is_overwrite);
+    RedirectionCommand(const BuiltinEntry *builtin, const CommandNode &node, const char *cmd_line);
 
     virtual ~RedirectionCommand() {
     }
@@ -68,15 +554,15 @@ public:
 };
 
 class PipeCommand : public Command {
-    Command* firstCommand = nullptr;
-    Command* secondCommand = nullptr;
-    bool am_i_with_AND;
+    std::vector<Command*> stages;
+    std::vector<int> outputFds; // STDERR_FILENO for stages piped with |&
 public:
-    PipeCommand(const char *cmd_line);
+    explicit PipeCommand(const PipelineNode &pipeline);
 
     virtual ~PipeCommand() {
-       delete firstCommand;
-        delete secondCommand;
+        for (Command* stage : stages) {
+            delete stage;
+        }
     }
 
     void execute() override;
@@ -118,9 +604,9 @@ public:
 };
 
 class ChangeDirCommand : public BuiltInCommand {
-    char* moveTo;
+    const char *moveTo;
 public:
-    ChangeDirCommand(char *path);
+    ChangeDirCommand(const char *path);
 
     virtual ~ChangeDirCommand() = default;
 
@@ -128,9 +614,9 @@ public:
 };
 
 class ChangePrompt : public BuiltInCommand {
-    std::string prompt;
+    const char *prompt;
 public:
-    explicit ChangePrompt(std::string const& prompt);
+    explicit ChangePrompt(const char *prompt);
 
     virtual ~ChangePrompt() = default;
 
@@ -177,7 +663,7 @@ class KillCommand : public BuiltInCommand {
     int job_id = -10;
 
 public:
-    KillCommand(const char *cmd_line, JobsList *jobs);
+    KillCommand(const char *cmd_line, int signum, int job_id);
 
     virtual ~KillCommand() {
     }
@@ -186,36 +672,146 @@ public:
 };
 
 
+/**
+ * A builtin running in the background on a worker thread. doneFd is an
+ * eventfd that becomes readable once the command has finished.
+ */
+struct BuiltinJob {
+    Command *command;
+    int doneFd;
+    int jobId = 0; // reported back by the pool when the job finishes
+    struct rusage usage = {}; // of the worker thread while it ran the command
+
+    BuiltinJob(Command *command, int doneFd) : command(command), doneFd(doneFd) {}
+
+    ~BuiltinJob();
+
+    /** Blocks until the command has finished. */
+    void wait();
+
+    /** How the command ended, as wait4 reports it: killed by the signal that cancelled it, or exit 0. */
+    int status() const { return command->getCancelSignal(); }
+};
+
+/**
+ * Worker threads for background builtins, started on first use. Workers
+ * block every signal and touch nothing but the job they are running.
+ */
+class ThreadPool {
+public:
+    static const size_t WORKERS = 4;
+
+    ThreadPool() = default;
+
+    ThreadPool(ThreadPool const &) = delete;
+
+    void operator=(ThreadPool const &) = delete;
+
+    ~ThreadPool();
+
+    void submit(BuiltinJob *job);
+
+    /** Finishes the running jobs and joins the workers. */
+    void stop();
+
+    /** A descriptor written to after each job, so the shell knows to reap. */
+    void setWakeFd(int fd) { wakeFd = fd; }
+
+    /** Replaces ids with the job ids of the jobs finished since the last call. */
+    void takeFinished(std::vector<int> &ids);
+
+private:
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<BuiltinJob *> queue;
+    std::vector<std::thread> workers;
+    std::vector<int> finished; // job ids, oldest first
+    size_t idle = 0;
+    bool stopping = false;
+    int wakeFd = -1;
+
+    void work();
+};
+
 class JobsList {
 public:
     class JobEntry {
         int jobId = 0;
         pid_t pid = -2;
         std::string commandLine;
+        BuiltinJob *builtin = nullptr;
+        int pidfd = -1; // refers to the process even after its pid is reused
+        bool stopped = false;
+        bool finished = false;
+        int status = 0; // as reported by wait4
+        struct rusage usage = {};
+        struct timespec started; // CLOCK_MONOTONIC
+        struct timespec ended = {0, 0};
     public:
-        JobEntry(pid_t m_pid, std::string line):pid(m_pid), commandLine(line){}
+        JobEntry(pid_t m_pid, const char *line, BuiltinJob *builtin = nullptr);
         JobEntry();
-        ~JobEntry() = default;
+        JobEntry(JobEntry const &) = delete;
+        void operator=(JobEntry const &) = delete;
+        ~JobEntry();
         void set_jobID(int id){jobId = id;}
         int getJobId() const { return jobId; }
         pid_t getPid() const { return pid; }
-        std::string getCommandLine() const { return commandLine; }
+        const std::string &getCommandLine() const { return commandLine; }
+        /** The worker-thread job of a background builtin, or nullptr for a process. */
+        BuiltinJob *getBuiltin() const { return builtin; }
+        int getPidfd() const { return pidfd; }
+        bool isStopped() const { return stopped; }
+        void setStopped(bool value) { stopped = value; }
+        bool isFinished() const { return finished; }
+        /** Records how the job ended, for jobs -l. */
+        void finish(int status, const struct rusage &usage);
+        /** Prints the job for jobs -l: its state, wall time and, once finished, its resource usage. */
+        void printLong(std::ostream &out) const;
+        /**
+         * Sends signum to the job's process. A builtin job is cancelled by a
+         * signal that would terminate a process, and cannot be stopped or continued.
+         */
+        bool sendSignal(int signum);
+        /**
+         * Resumes the job and waits in the foreground until it has finished, and
+         * reaps its process. Returns false if it was stopped by ctrl-Z instead.
+         */
+        bool wait();
     };
-    std::vector<JobEntry*> jobsVector;
+    ThreadPool pool;
     int getNextJobID();
 
-    JobsList() = default;
+    /** The number of jobs in the list. */
+    size_t size() const { return count; }
+
+    JobsList();
+
+    ~JobsList();
+
+    /** Readable when a child changed state (a signalfd for SIGCHLD). */
+    int getChildFd() const { return childFd; }
+
+    /** Readable when a background builtin finished. */
+    int getWakeFd() const { return wakePipe[0]; }
 
-    ~JobsList(){jobsVector.clear();}
+    /** Empties getChildFd(); the next removeFinishedJobs() still looks for finished jobs. */
+    void drainChildFd();
 
-    void addJob(Command *cmd, pid_t pid_to_use);
+    void addJob(Command *cmd, pid_t pid_to_use, bool stopped = false);
 
-    void printJobsList_forJOBS();
+    /** Runs a thread-safe builtin in the background; the job takes ownership of cmd. */
+    bool addBuiltinJob(Command *cmd);
 
-    void printJobsList_forQUIT();
+    void printJobsList_forJOBS(std::ostream &out);
 
+    void printJobsList_forQUIT(std::ostream &out);
 
-    void removeFinishedJobs();
+    /** Prints the jobs and then the recently finished ones with their resource usage. */
+    void printJobsList_long(std::ostream &out);
+
+
+    /** Removes the jobs that finished; when done is given, each is listed on it. */
+    void removeFinishedJobs(std::ostream *done = nullptr);
 
     void send_SIGKILL_to_all_jobs();
 
@@ -230,14 +826,26 @@ public:
     bool is_there_a_job_with_pid(const int pid);
 
     int getMaxID() {
-        removeFinishedJobs();
-        int max = -1;
-        for (auto job:jobsVector) {
-            if (job->getJobId() > max)
-                max = job->getJobId();
-        }
-        return max;
+        return slots.empty() ? -1 : (int) slots.size() - 1;
     }
+
+private:
+    // indexed by job id, with slot 0 unused; the last slot always holds a
+    // job, so the next id (the largest plus one) is the size of the table
+    std::vector<JobEntry*> slots;
+    std::unordered_map<pid_t, int> idsByPid; // jobs running as processes
+    size_t count = 0;
+    std::vector<int> finishedBuiltins; // taken from the pool, kept to reuse its storage
+    std::deque<JobEntry*> history; // the last JOB_HISTORY_SIZE finished jobs, oldest first
+    int wakePipe[2];
+    int childFd;
+    bool childChanged = false; // set when drainChildFd() took a SIGCHLD
+
+    void insert(JobEntry *job);
+
+    void release(int jobId);
+
+    void removeJobByPid(pid_t pid);
 };
 
 
@@ -254,10 +862,35 @@ public:
     void execute() override;
 };
 
+class BackgroundCommand : public BuiltInCommand {
+    int jobId; // 0 for the last stopped job
+
+public:
+    BackgroundCommand(const char *cmd_line, int id);
+
+    virtual ~BackgroundCommand() = default;
+
+    void execute() override;
+};
+
+class WaitCommand : public BuiltInCommand {
+    std::vector<int> jobIds; // empty for every job
+    bool any;
+    int timeout; // in seconds, -1 for none
+
+public:
+    WaitCommand(const char *cmd_line, const std::vector<int> &ids, bool any, int timeout);
+
+    virtual ~WaitCommand() = default;
+
+    void execute() override;
+};
+
 class AliasCommand : public BuiltInCommand {
-    const char* cmd_line;
+    std::string cmd_line;
+    int argc;
 public:
-    explicit AliasCommand(const char *cmd_line);
+    AliasCommand(const char *cmd_line, int argc);
     virtual ~AliasCommand() {
     }
 
@@ -265,10 +898,11 @@ public:
 };
 
 class UnAliasCommand : public BuiltInCommand {
-    const char* cmd_line;
+    char **argv;
+    int argc;
 public:
 
-    UnAliasCommand(const char *cmd_line);
+    UnAliasCommand(char **argv, int argc);
 
     virtual ~UnAliasCommand() {
     }
@@ -280,7 +914,7 @@ class UnSetEnvCommand : public BuiltInCommand {
     char **args;
     int agrc;
 public:
-    UnSetEnvCommand(const char *command_line);
+    UnSetEnvCommand(char **argv, int argc);
 
     virtual ~UnSetEnvCommand() {
     }
@@ -298,37 +932,124 @@ public:
     void execute() override;
 };
 
+/**
+ * Waits on file descriptors with epoll and calls their handlers.
+ * A descriptor epoll cannot watch, such as a regular file, is always ready.
+ */
+class EventLoop {
+public:
+    typedef std::function<void()> Handler;
+
+    EventLoop();
+
+    ~EventLoop();
+
+    EventLoop(EventLoop const &) = delete;
+
+    void operator=(EventLoop const &) = delete;
+
+    /** Calls handler whenever fd is readable, until unwatch(fd). */
+    bool watch(int fd, Handler handler);
+
+    void unwatch(int fd);
+
+    /** Dispatches events until stop() is called. */
+    void run();
+
+    void stop() { running = false; }
+
+private:
+    struct Source {
+        std::shared_ptr<Handler> handler; // shared, so dispatching it never copies the function
+        bool alwaysReady;
+    };
+
+    int epollFd;
+    bool running = false;
+    std::unordered_map<int, Source> sources; // by descriptor
+    size_t alwaysReady = 0;
+
+    void dispatch(int fd);
+};
+
 class SmallShell {
 private:
+    struct HereDocument {
+        const Redirection *redirection;
+        std::string body;
+    };
+
     std::string currentPrompt = "smash";
     char* previousDir;
-    std::vector<std::pair<std::string, std::string>> aliasVector;
+    AliasTable aliasTable;
+    ParseCache parseCache;
+    SpawnBackend spawnBackend = SPAWN_POSIX;
+    int pipeBufferSize = 0;
+    PipeStats* pipeStats;
+    PathCache pathCache;
     JobsList* m_job_list;
+    std::vector<HereDocument> hereDocuments; // of the line being executed
+    int signalFd; // SIGINT and SIGTSTP
+    pid_t shellPid = getpid(); // forked pipeline stages have their own pid
+    std::thread::id mainThread = std::this_thread::get_id();
+    unsigned signalPolls = 0;
+    std::string input; // read from stdin but not yet taken as lines
+    bool inputEnded = false;
+    EventLoop eventLoop;
     SmallShell();
 
+    void readHereDocuments(const ParsedLine &parsedLine);
+
 public:
 
-    pid_t pid_of_foreGround = -10;
+    /** The job the shell is waiting for, which ctrl-C and ctrl-Z act on. */
+    struct Foreground {
+        pid_t pgid = -10; // -10 when there is none
+        Command* builtin = nullptr; // the builtin running in the foreground, or one brought back by fg
+        std::vector<Command*> stages; // the builtin stages of a pipeline running as threads
+        bool stoppable = false; // whether the waiter can put it in the jobs list
+        bool stopped = false; // set by ctrl-Z
+        bool interrupted = false; // set by a ctrl-C when there is no job to forward it to
+    };
+
+    Foreground foreground;
+
+    SpawnBackend getSpawnBackend() const { return spawnBackend; }
+
+    void setSpawnBackend(SpawnBackend backend) { spawnBackend = backend; }
+
+    PathCache& getPathCache() { return pathCache; }
+
+    int getPipeBufferSize() const { return pipeBufferSize; }
+
+    void setPipeBufferSize(int size) { pipeBufferSize = size; }
+
+    PipeStats* getPipeStats() { return pipeStats; }
 
     char** getPreviousDirPtr() {return &previousDir;}
 
     void setPreviousDirPtr(char* ptr) {previousDir = ptr;}
 
-    std::vector<std::pair<std::string, std::string>>& getAliasVector()
-    {return aliasVector;}
+    AliasTable& getAliasTable()
+    {return aliasTable;}
+
+    void printAlias(std::ostream& out);
 
-    void printAlias();
+    bool addAlias(const std::string& name, const std::string& value);
 
-    void addAlias(char** argv);
+    bool removeAlias(const std::string& name);
 
-    void addAlias(char** argv, const char* cmd_line);
     Command *CreateCommand(const char *cmd_line);
 
-    std::string getPrompt() const {
+    Command *CreateCommand(const PipelineNode &pipeline);
+
+    Command *CreateCommand(const CommandNode &node, const char *cmd_line, bool background);
+
+    const std::string &getPrompt() const {
         return currentPrompt;
     }
 
-    void setPrompt(std::string const & prompt) {
+    void setPrompt(const char *prompt) {
         currentPrompt = prompt;
     }
 
@@ -347,19 +1068,127 @@ public:
 
     void executeCommand(const char *cmd_line);
 
+    /** Reads once from stdin, blocking until input arrives; false at end of input. */
+    bool readInput();
+
+    /**
+     * Takes the next complete line of what readInput() read. At end of input
+     * the unterminated rest counts as a line.
+     */
+    bool nextLine(std::string &line);
+
+    bool inputEndReached() const { return inputEnded; }
+
+    /**
+     * Runs the shell's main loop: executes the lines read from stdin and
+     * reports finished jobs, until the end of input.
+     */
+    void run();
+
+    /** Reads a line of here-document from the shell's input, prompting at a terminal; false at end of input. */
+    bool readContinuation(std::string &line);
+
+    /** The body of a here-document or here-string of the line being executed. */
+    const std::string *getHereDocument(const Redirection *redirection) const;
+
+    /** False in a forked pipeline stage, which must not act as the shell. */
+    bool isShellProcess() const { return getpid() == shellPid; }
+
+    /** Readable when a signal for the shell itself, SIGINT or SIGTSTP, arrived. */
+    int getSignalFd() const { return signalFd; }
+
+    /** Handles the signals that arrived on getSignalFd(). */
+    void handleSignals();
+
+    /**
+     * Calls handleSignals() if signals arrived while the main thread runs a
+     * builtin. Cheap enough for every isCancelled(): only every
+     * SIGNAL_POLL_INTERVAL-th call on the main thread looks at the signalfd.
+     */
+    void pollSignals();
+
+    /**
+     * Blocks until one of fds, which belong to the foreground job, is
+     * readable, and returns its index. Signals for the shell are handled
+     * meanwhile. Returns -1 if the job was stopped, the shell itself was
+     * interrupted, or timeout milliseconds (unless -1) passed.
+     */
+    int waitForeground(const int *fds, int count, int timeout = -1);
+
+    void waitForeground(int fd) { waitForeground(&fd, 1); }
+
+    /**
+     * Waits for the foreground process pid and reaps it, or only collects
+     * its stop after a ctrl-Z. Waits on pidfd, or on SIGCHLD when it is -1.
+     * Returns wait4's result.
+     */
+    pid_t reapForeground(pid_t pid, int pidfd, int *status, struct rusage *usage);
+
+    EventLoop& getEventLoop() {
+        return eventLoop;
+    }
+
     JobsList* getJobList() {
         return m_job_list;
     }
+
+    ParseCache& getParseCache() {
+        return parseCache;
+    }
 };
 
 class JobsCommand : public BuiltInCommand {
+    bool longFormat;
 public:
-    explicit JobsCommand(const char *cmd_line): BuiltInCommand(cmd_line){}
+    explicit JobsCommand(const char *cmd_line, bool longFormat = false): BuiltInCommand(cmd_line),
+        longFormat(longFormat){}
 
     virtual ~JobsCommand() = default;
 
     void execute() override {
-        SmallShell::getInstance().getJobList()->printJobsList_forJOBS();
+        JobsList* jobs = SmallShell::getInstance().getJobList();
+        if (longFormat) jobs->printJobsList_long(out());
+        else jobs->printJobsList_forJOBS(out());
     }
 };
+class CmdCacheCommand : public BuiltInCommand {
+    bool clear;
+    int capacity;
+public:
+    CmdCacheCommand(const char *cmd_line, bool clear, int capacity);
+
+    virtual ~CmdCacheCommand() = default;
+
+    void execute() override;
+};
+enum SetOption {SET_PRINT, SET_SPAWN, SET_PIPEBUF};
+
+class SetCommand : public BuiltInCommand {
+    SetOption option;
+    long value;
+public:
+    SetCommand(const char *cmd_line, SetOption option, long value);
+
+    virtual ~SetCommand() = default;
+
+    void execute() override;
+};
+class HashCommand : public BuiltInCommand {
+    bool reset;
+public:
+    HashCommand(const char *cmd_line, bool reset);
+
+    virtual ~HashCommand() = default;
+
+    void execute() override;
+};
+class PipeStatCommand : public BuiltInCommand {
+    bool clear;
+public:
+    PipeStatCommand(const char *cmd_line, bool clear);
+
+    virtual ~PipeStatCommand() = default;
+
+    void execute() override;
+};
 #endif //SMASH_COMMAND_H_
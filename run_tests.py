@@ -16,6 +16,8 @@ import pwd
 import socket
 import platform
 import datetime
+import collections
+import fcntl
 
 # -----------------------------------------------------
 # Colors
@@ -37,6 +39,15 @@ SIM_BIN = [sys.executable, os.path.abspath(__file__), "--sim"]
 
 PROMPT_CHARS = ["smash> ", "smash>"]
 PID_RE = re.compile(r'\b\d{2,6}\b')
+# jobs -l: "[id] cmd : pid state wall=... user=..."; only id, cmd and state are stable
+JOBS_LONG_RE = re.compile(r'^(.*\[\d+\] .* : )\d+ (\S+) wall=.*$')
+# pipestat: the stages' context switches depend on scheduling
+PIPESTAT_RE = re.compile(r'^(pipestat: \d+ pipes, \d+ writer blocks, )\d+( stage context switches)$')
+JOB_HISTORY_SIZE = 16
+PARSE_CACHE_SIZE = 256
+SPAWN_BACKENDS = ("posix", "vfork", "fork")
+F_SETPIPE_SZ = getattr(fcntl, "F_SETPIPE_SZ", 1031)
+HEREDOC_RE = re.compile(r'(?<!<)<<(?!<)\s*([^\s<>|&]+)')
 PROMPT_DEFAULT = "smash"
 
 
@@ -120,6 +131,15 @@ def normalize_line(line):
         if l.startswith(p):
             l = l[len(p):]
 
+    # CASE 0 — jobs -l, whose pid and resource usage vary
+    m = JOBS_LONG_RE.match(l)
+    if m:
+        return m.group(1) + "<PID> " + m.group(2)
+
+    m = PIPESTAT_RE.match(l)
+    if m:
+        return m.group(1) + "<N>" + m.group(2)
+
     # CASE 1 — last token is PID
     tokens = l.split()
     if len(tokens) >= 2:
@@ -334,7 +354,18 @@ class SmashShell:
         self.fg_job = None
         self.aliases = {}
         self.history = []
+        self.finished = []  # (job, status) of the last JOB_HISTORY_SIZE finished jobs
         self.oldpwd = None
+        # like smash's ParseCache: raw line -> alias generation, least recently used first
+        self.parse_cache = collections.OrderedDict()
+        self.parse_cache_capacity = PARSE_CACHE_SIZE
+        self.parse_generation = 0
+        self.parse_hits = 0
+        self.parse_misses = 0
+        self.path_cache = {}  # like smash's PathCache: name -> [path or "", hits]
+        self.spawn = "posix"
+        self.pipebuf = 0  # as the kernel applied it; 0 for the default
+        self.pipes = 0  # pipes made for pipelines, as pipestat counts them
 
         signal.signal(signal.SIGINT, self.handle_sigint)
 
@@ -349,17 +380,24 @@ class SmashShell:
         alive = []
         for job in self.jobs:
             try:
-                pid, _ = os.waitpid(job.pid, os.WNOHANG)
+                pid, status = os.waitpid(job.pid, os.WNOHANG)
                 if pid == 0:
                     alive.append(job)
+                else:
+                    self.retire_job(job, status)
             except:
                 pass
         self.jobs = alive
 
+    def retire_job(self, job, status):
+        self.finished.append((job, status))
+        del self.finished[:-JOB_HISTORY_SIZE]
+
     def add_job(self, pid, cmd_line, pgid=None, stopped=False):
-        job = Job(self.next_job_id, pid, cmd_line, time.time(), stopped, pgid)
+        # like smash: one more than the largest id in use
+        job_id = max([j.job_id for j in self.jobs], default=0) + 1
+        job = Job(job_id, pid, cmd_line, time.time(), stopped, pgid)
         self.jobs.append(job)
-        self.next_job_id += 1
         return job
 
     def find_job_by_id(self, job_id):
@@ -368,6 +406,37 @@ class SmashShell:
                 return job
         return None
 
+    def lookup_line(self, line):
+        """Counts the line against the parse cache, as smash does for every line it reads."""
+        if line in self.parse_cache:
+            self.parse_cache.move_to_end(line)
+            if self.parse_cache[line] == self.parse_generation:
+                self.parse_hits += 1
+                return
+            self.parse_misses += 1
+            self.parse_cache[line] = self.parse_generation
+            return
+        self.parse_misses += 1
+        if len(self.parse_cache) >= self.parse_cache_capacity:
+            self.parse_cache.popitem(last=False)
+        self.parse_cache[line] = self.parse_generation
+
+    def hash_command(self, name):
+        """Resolves an external command through PATH as smash does, counting a hit when found."""
+        if "/" in name:
+            return
+        if name not in self.path_cache:
+            found = ""
+            for directory in os.environ.get("PATH", "/bin:/usr/bin").split(":"):
+                candidate = f"{directory or '.'}/{name}"
+                if os.path.isfile(candidate) and os.access(candidate, os.X_OK):
+                    found = candidate
+                    break
+            self.path_cache[name] = [found, 0]
+        entry = self.path_cache[name]
+        if entry[0]:
+            entry[1] += 1
+
     def update_job_finished(self, pid):
         self.jobs = [j for j in self.jobs if j.pid != pid]
 
@@ -432,13 +501,26 @@ class SmashShell:
             self.print_error("smash error: chdir failed")
 
     def cmd_jobs(self, args):
+        if args == ["-l"]:
+            self.cleanup_jobs()
+            for job in sorted(self.jobs, key=lambda j: j.job_id):
+                state = "stopped" if job.is_stopped else "running"
+                print(f"[{job.job_id}] {job.cmd_line} : {job.pid} {state} wall=0.000s")
+            for job, status in self.finished:
+                if os.WIFSIGNALED(status):
+                    state = f"signal={os.WTERMSIG(status)}"
+                else:
+                    state = f"exit={os.WEXITSTATUS(status)}"
+                print(f"[{job.job_id}] {job.cmd_line} : {job.pid} {state} wall=0.000s")
+            return
         if args:
             self.print_error("smash error: jobs: invalid arguments")
             return
         self.cleanup_jobs()
 
         for job in sorted(self.jobs, key=lambda j: j.job_id):
-            print(f"[{job.job_id}] {job.cmd_line}")  # exact original, with &
+            stopped = " (stopped)" if job.is_stopped else ""
+            print(f"[{job.job_id}] {job.cmd_line}{stopped}")  # exact original, with &
 
     def cmd_fg(self, args):
         self.cleanup_jobs()
@@ -478,13 +560,98 @@ class SmashShell:
             pass
 
         try:
-            os.waitpid(job.pid, 0)
+            _, status = os.waitpid(job.pid, 0)
+            self.retire_job(job, status)
         except:
             pass
 
         self.update_job_finished(job.pid)
         self.fg_job = None
 
+    def cmd_kill(self, args):
+        if len(args) != 2 or not args[0].startswith("-") or not args[0][1:].isdigit() \
+                or not args[1].isdigit():
+            self.print_error("smash error: kill: invalid arguments")
+            return
+        signum, jid = int(args[0][1:]), int(args[1])
+        self.cleanup_jobs()
+        job = self.find_job_by_id(jid)
+        if job is None:
+            self.print_error(f"smash error: kill: job-id {jid} does not exist")
+            return
+        try:
+            os.kill(job.pid, signum)
+        except OSError:
+            self.print_error("smash error: kill failed")
+            return
+        if signum in (signal.SIGSTOP, signal.SIGTSTP):
+            job.is_stopped = True
+        elif signum == signal.SIGCONT:
+            job.is_stopped = False
+        print(f"signal number {signum} was sent to pid {job.pid}")
+
+    def cmd_bg(self, args):
+        if len(args) > 1 or (args and not args[0].isdigit()):
+            self.print_error("smash error: bg: invalid arguments")
+            return
+        self.cleanup_jobs()
+        if args:
+            jid = int(args[0])
+            job = self.find_job_by_id(jid)
+            if job is None:
+                self.print_error(f"smash error: bg: job-id {jid} does not exist")
+                return
+            if not job.is_stopped:
+                self.print_error(f"smash error: bg: job-id {jid} is already running in the background")
+                return
+        else:
+            stopped = sorted([j for j in self.jobs if j.is_stopped], key=lambda j: j.job_id)
+            if not stopped:
+                self.print_error("smash error: bg: there is no stopped jobs to resume")
+                return
+            job = stopped[-1]
+        print(f"{job.cmd_line} {job.pid}")
+        os.kill(job.pid, signal.SIGCONT)
+        job.is_stopped = False
+
+    def cmd_wait(self, args):
+        ids, any_job, timeout = [], False, None
+        i = 0
+        while i < len(args) and args[i].startswith("-"):
+            if args[i] == "-n":
+                any_job = True
+            elif args[i] == "-t" and i + 1 < len(args) and args[i + 1].isdigit():
+                i += 1
+                timeout = int(args[i])
+            else:
+                self.print_error("smash error: wait: invalid arguments")
+                return
+            i += 1
+        for arg in args[i:]:
+            if not arg.isdigit():
+                self.print_error("smash error: wait: invalid arguments")
+                return
+            ids.append(int(arg))
+
+        self.cleanup_jobs()
+        for jid in ids:
+            if self.find_job_by_id(jid) is None:
+                self.print_error(f"smash error: wait: job-id {jid} does not exist")
+                return
+
+        waiting = [j.pid for j in self.jobs if not ids or j.job_id in ids]
+        deadline = None if timeout is None else time.time() + timeout
+        while True:
+            self.cleanup_jobs()
+            alive = set(j.pid for j in self.jobs)
+            finished = len([p for p in waiting if p not in alive])
+            if finished == len(waiting) or (any_job and finished):
+                return
+            if deadline is not None and time.time() >= deadline:
+                self.print_error("smash error: wait: timed out")
+                return
+            time.sleep(0.01)
+
     def cmd_quit(self, args):
         if len(args) > 1 or (len(args) == 1 and args[0] != "kill"):
             self.print_error("smash error: quit: invalid arguments")
@@ -529,6 +696,7 @@ class SmashShell:
             val = val[1:-1]
 
         self.aliases[name] = val
+        self.parse_generation += 1
 
     def cmd_unalias(self, args):
         if len(args) != 1:
@@ -538,6 +706,77 @@ class SmashShell:
             self.print_error(f"smash error: unalias: {args[0]} alias does not exist")
             return
         del self.aliases[args[0]]
+        self.parse_generation += 1
+
+    def cmd_cmdcache(self, args):
+        if not args:
+            print(f"cmdcache: {self.parse_hits} hits, {self.parse_misses} misses, "
+                  f"{len(self.parse_cache)}/{self.parse_cache_capacity} entries")
+        elif args == ["-c"]:
+            self.parse_generation += 1
+            self.parse_hits = 0
+            self.parse_misses = 0
+        elif len(args) == 2 and args[0] == "-s" and args[1].isdigit() and int(args[1]) > 0:
+            self.parse_cache_capacity = int(args[1])
+            # the line being executed is never dropped
+            while len(self.parse_cache) > max(self.parse_cache_capacity, 1):
+                self.parse_cache.popitem(last=False)
+        else:
+            self.print_error("smash error: cmdcache: invalid arguments")
+
+    def cmd_hash(self, args):
+        if not args:
+            found = sorted((name, entry) for name, entry in self.path_cache.items() if entry[0])
+            if not found:
+                print("smash: hash table empty")
+                return
+            print("hits\tcommand")
+            for name, (path, hits) in found:
+                print(f"{hits:4}\t{path}")
+        elif args == ["-r"]:
+            self.path_cache.clear()
+        else:
+            self.print_error("smash error: hash: invalid arguments")
+
+    def cmd_set(self, args):
+        if not args:
+            print(f"spawn={self.spawn}")
+            print(f"pipebuf={self.pipebuf or 'default'}")
+            return
+        if len(args) == 1 and args[0].startswith("spawn=") and args[0][6:] in SPAWN_BACKENDS:
+            self.spawn = args[0][6:]
+            return
+        m = re.fullmatch(r"pipebuf=(\d+)([kKmMgG]?)", args[0]) if len(args) == 1 else None
+        if not m:
+            self.print_error("smash error: set: invalid arguments")
+            return
+        size = int(m.group(1)) << {"": 0, "k": 10, "m": 20, "g": 30}[m.group(2).lower()]
+        if size == 0:
+            self.pipebuf = 0
+            return
+        try:
+            with open("/proc/sys/fs/pipe-max-size") as f:
+                size = min(size, int(f.read()))
+        except (OSError, ValueError):
+            size = min(size, 1024 * 1024)
+        # the kernel rounds the size up; smash keeps what it applied
+        r, w = os.pipe()
+        try:
+            self.pipebuf = fcntl.fcntl(w, F_SETPIPE_SZ, size)
+        except OSError as e:
+            self.print_error(f"smash error: fcntl failed: {e.strerror}")
+        finally:
+            os.close(r)
+            os.close(w)
+
+    def cmd_pipestat(self, args):
+        if not args:
+            # small outputs never fill a pipe; switches are masked when comparing
+            print(f"pipestat: {self.pipes} pipes, 0 writer blocks, 0 stage context switches")
+        elif args == ["-c"]:
+            self.pipes = 0
+        else:
+            self.print_error("smash error: pipestat: invalid arguments")
 
     def cmd_du(self, args):
         if len(args) > 1:
@@ -731,6 +970,9 @@ class SmashShell:
         elif cmd == "cd":       self.cmd_cd(args)
         elif cmd == "jobs":     self.cmd_jobs(args)
         elif cmd == "fg":       self.cmd_fg(args)
+        elif cmd == "wait":     self.cmd_wait(args)
+        elif cmd == "kill":     self.cmd_kill(args)
+        elif cmd == "bg":       self.cmd_bg(args)
         elif cmd == "quit":     self.cmd_quit(args)
         elif cmd == "alias":    self.cmd_alias(args)
         elif cmd == "unalias":  self.cmd_unalias(args)
@@ -739,15 +981,35 @@ class SmashShell:
         elif cmd == "unsetenv": self.cmd_unsetenv(args)
         elif cmd == "sysinfo":  self.cmd_sysinfo(args)
         elif cmd == "usbinfo":  self.cmd_usbinfo(args)
+        elif cmd == "cmdcache": self.cmd_cmdcache(args)
+        elif cmd == "hash":     self.cmd_hash(args)
+        elif cmd == "set":      self.cmd_set(args)
+        elif cmd == "pipestat": self.cmd_pipestat(args)
 
     # --------------------------------------------------------
     # EXTERNAL COMMAND EXECUTION
     # --------------------------------------------------------
 
-    def run_external(self, line, background, original_line):
-        special_chars = ["|", "|&", ">", ">>", "*", "?"]
-
-        if any(c in line for c in special_chars):
+    def read_heredocs(self, line):
+        """Reads the bodies of the line's here-documents, each up to its delimiter."""
+        body = ""
+        for delimiter in HEREDOC_RE.findall(line):
+            while True:
+                try:
+                    text = input()
+                except EOFError:
+                    return body
+                body += text + "\n"
+                if text == delimiter:
+                    break
+        return body
+
+    def run_external(self, line, background, original_line, heredoc=""):
+        special_chars = ["|", "|&", ">", ">>", "<", "*", "?"]
+
+        if heredoc:
+            cmd = ["bash", "-c", line + "\n" + heredoc]
+        elif any(c in line for c in special_chars):
             cmd = ["bash", "-c", line]
         else:
             try:
@@ -764,7 +1026,8 @@ class SmashShell:
         pgid = p.pid
 
         if background:
-            self.add_job(p.pid, original_line, pgid)
+            # keep p, or subprocess reaps the child itself and its status is lost
+            self.add_job(p.pid, original_line, pgid).proc = p
             return
 
         self.fg_job = Job(-1, p.pid, line, time.time(), False, pgid)
@@ -778,11 +1041,13 @@ class SmashShell:
     # --------------------------------------------------------
 
     def execute_line(self, line):
+        self.lookup_line(line)
         line = line.strip()
         if not line:
             return
 
         original_line = line  # preserve exact input (with &)
+        heredoc = self.read_heredocs(line)
         self.cleanup_jobs()
         self.history.append(line)
 
@@ -812,8 +1077,17 @@ class SmashShell:
             cleaned, out_file, append, ok = self.parse_redirection(tokens)
             if not ok:
                 return
+            # each stage is looked up in PATH, then bash runs the pipeline
+            stage_start = True
+            for token in cleaned:
+                if token in ("|", "|&"):
+                    stage_start = True
+                elif stage_start:
+                    self.hash_command(token)
+                    stage_start = False
+            self.pipes += sum(1 for token in cleaned if token in ("|", "|&"))
             # Let bash handle actual redirection and pipeline
-            self.run_external(line, background, original_line)
+            self.run_external(line, background, original_line, heredoc)
             return
 
         # No pipes: handle redirection + builtin/external
@@ -827,9 +1101,9 @@ class SmashShell:
         args = cleaned[1:]
 
         builtin_cmds = {
-            "chprompt", "showpid", "pwd", "cd", "jobs", "fg", "quit",
+            "chprompt", "showpid", "pwd", "cd", "jobs", "fg", "bg", "kill", "wait", "quit",
             "alias", "unalias", "du", "whoami", "unsetenv", "sysinfo",
-            "usbinfo"
+            "usbinfo", "cmdcache", "hash", "set", "pipestat"
         }
 
         if cmd in builtin_cmds:
@@ -866,7 +1140,8 @@ class SmashShell:
             return
 
         # External simple command (no pipes).
-        self.run_external(line, background, original_line)
+        self.hash_command(cmd)
+        self.run_external(line, background, original_line, heredoc)
 
     # --------------------------------------------------------
     # LOOP
@@ -2,26 +2,51 @@
 #include <signal.h>
 #include "signals.h"
 
-#include <sys/wait.h>
-
 #include "Commands.h"
 
 using namespace std;
 
+/**
+ * Runs in the main thread when SIGINT arrives on the shell's signalfd, so it
+ * may use iostreams and the shell freely. The whole foreground process group
+ * is interrupted and the pipeline stages running as threads are cancelled,
+ * which takes down every stage of a pipeline. A builtin running in the
+ * foreground is cancelled; it sees this through Command::isCancelled().
+ */
 void ctrlCHandler(int sig_num) {
     cout << "smash: got ctrl-C" << endl;
-    if (SmallShell::getInstance().pid_of_foreGround == -10)
+    SmallShell& smash = SmallShell::getInstance();
+    for (Command *stage : smash.foreground.stages) {
+        stage->cancel(sig_num);
+    }
+    pid_t pgid = smash.foreground.pgid;
+    if (pgid == -10) {
+        // no process to report: only a builtin, if any, is cancelled
+        if (smash.foreground.builtin) smash.foreground.builtin->cancel(sig_num);
+        smash.foreground.interrupted = true;
+        return;
+    }
+    if (kill(-pgid, sig_num) == -1) {
+        perror("smash error: kill failed");
         return;
-    pid_t is_foreGround = waitpid(SmallShell::getInstance().pid_of_foreGround,
-        nullptr, WNOHANG);
-    if (!is_foreGround) {
-        if (!kill(SmallShell::getInstance().pid_of_foreGround, SIGINT)) {
-            cout << "smash: process " << SmallShell::getInstance().pid_of_foreGround <<" was killed" << endl;
-        } else {
-            perror("smash error: kill failed");
-        }
     }
-    else {
-        SmallShell::getInstance().pid_of_foreGround = -10;
+    cout << "smash: process " << pgid << " was killed" << endl;
+}
+
+/**
+ * Runs in the main thread like ctrlCHandler. The foreground job is stopped
+ * with SIGSTOP, which it cannot ignore, and its waiter puts it in the jobs list.
+ */
+void ctrlZHandler(int sig_num) {
+    cout << "smash: got ctrl-Z" << endl;
+    SmallShell& smash = SmallShell::getInstance();
+    pid_t pgid = smash.foreground.pgid;
+    if (pgid == -10 || !smash.foreground.stoppable)
+        return;
+    if (kill(-pgid, SIGSTOP) == -1) {
+        perror("smash error: kill failed");
+        return;
     }
+    smash.foreground.stopped = true;
+    cout << "smash: process " << pgid << " was stopped" << endl;
 }
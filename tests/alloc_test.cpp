@@ -0,0 +1,151 @@
+#include <iostream>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../Commands.h"
+
+/**
+ * Runs each builtin until the shell is warm, then fails if running it again
+ * touches the heap, both called directly and read as lines by the main loop.
+ * Every allocation path (operator new and the malloc family) is counted.
+ */
+
+static unsigned long allocations = 0;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+}
+
+void *operator new(size_t size) {
+    allocations++;
+    void *ptr = __libc_malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    __libc_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    __libc_free(ptr);
+}
+
+static const char *WARM_COMMANDS[] = {
+    "pwd",
+    "showpid",
+    "jobs",
+    "chprompt a_prompt_longer_than_small_strings",
+    "chprompt",
+};
+
+/** Runs the main loop over lines fed to it on stdin and returns how often it allocated. */
+static unsigned long runLines(const std::string &lines) {
+    int fds[2];
+    if (pipe(fds) == -1) return 0;
+    if (write(fds[1], lines.data(), lines.size()) != (ssize_t)lines.size()) return 0;
+    close(fds[1]);
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+    unsigned long before = allocations;
+    SmallShell::getInstance().run();
+    return allocations - before;
+}
+
+int main() {
+    SmallShell &smash = SmallShell::getInstance();
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+
+    smash.executeCommand("sleep 100 &");
+    for (int round = 0; round < 3; round++) {
+        for (const char *command : WARM_COMMANDS) {
+            smash.executeCommand(command);
+        }
+    }
+
+    int failures = 0;
+    for (const char *command : WARM_COMMANDS) {
+        unsigned long before = allocations;
+        for (int round = 0; round < 100; round++) {
+            smash.getJobList()->removeFinishedJobs();
+            smash.executeCommand(command);
+        }
+        unsigned long count = allocations - before;
+        if (count) {
+            std::cerr << "FAIL: '" << command << "' allocated " << count << " times in 100 warm runs" << std::endl;
+            failures++;
+        }
+    }
+
+    // the main loop collects its job reports in a BufferSink it keeps
+    BufferSink sink;
+    std::ostream report(&sink);
+    for (int round = 0; round < 3; round++) {
+        sink.clear();
+        smash.getJobList()->printJobsList_forJOBS(report);
+    }
+    unsigned long before = allocations;
+    for (int round = 0; round < 100; round++) {
+        sink.clear();
+        smash.getJobList()->printJobsList_forJOBS(report);
+    }
+    if (sink.str().find("sleep 100") == std::string::npos) {
+        std::cerr << "FAIL: BufferSink lost the jobs list: '" << sink.str() << "'" << std::endl;
+        failures++;
+    } else if (allocations != before) {
+        std::cerr << "FAIL: a reused BufferSink allocated " << allocations - before << " times in 100 reports" << std::endl;
+        failures++;
+    }
+
+    // lines must cost nothing: a long script, which takes several reads with
+    // lines straddling their ends, allocates no more than a single round
+    std::string round, script;
+    for (const char *command : WARM_COMMANDS) {
+        round += command;
+        round += '\n';
+    }
+    for (int i = 0; i < 100; i++) script += round;
+    runLines(script);
+    unsigned long single = runLines(round);
+    unsigned long count = runLines(script);
+    if (count != single) {
+        std::cerr << "FAIL: the main loop allocated " << count - single << " more times for 100 rounds of warm lines than for one" << std::endl;
+        failures++;
+    }
+
+    smash.getJobList()->send_SIGKILL_to_all_jobs();
+    std::cout.flush();
+    dup2(saved_stdout, STDOUT_FILENO);
+    if (!failures) std::cout << "PASS: warm builtins are allocation-free" << std::endl;
+    return failures ? 1 : 0;
+}